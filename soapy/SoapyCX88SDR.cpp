@@ -0,0 +1,812 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * SoapyCX88SDR.cpp - SoapySDR module for the CX2388x SDR V4L2 Driver
+ * Copyright (c) 2020 Jorge Maidana <jorgem.seq@gmail.com>
+ *
+ * Streams straight out of the mmap()'d DMA ring with CX88SDR_IOC_G_SEGMENTS
+ * and CX88SDR_IOC_RELEASE, the samples are only copied once, when they are
+ * converted into the buffers of the application. In the native real format
+ * the ring pages are also available through direct buffer access. The rate,
+ * input and gain are the V4L2 controls of the driver.
+ */
+
+#include <SoapySDR/Device.hpp>
+#include <SoapySDR/Formats.hpp>
+#include <SoapySDR/Logger.hpp>
+#include <SoapySDR/Registry.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "cx88_sdr_uapi.h"
+
+static const struct cx88sdr_rate cx88sdr_rates[CX88SDR_RATE_NUM] = CX88SDR_RATES;
+
+/* The card field of VIDIOC_QUERYCAP */
+#define CX88SDR_CARD_NAME	"CX2388x SDR"
+
+/* Ring pages handed out by one readStream() or acquireReadBuffer() call */
+#define CX88SDR_MTU_PAGES	16
+
+static int cx88sdr_ctrl_get(int fd, uint32_t id)
+{
+	struct v4l2_control ctrl = {};
+
+	ctrl.id = id;
+	if (ioctl(fd, VIDIOC_G_CTRL, &ctrl))
+		throw std::runtime_error("VIDIOC_G_CTRL: " + std::string(strerror(errno)));
+	return ctrl.value;
+}
+
+static void cx88sdr_ctrl_set(int fd, uint32_t id, int value)
+{
+	struct v4l2_control ctrl = {};
+
+	ctrl.id = id;
+	ctrl.value = value;
+	if (ioctl(fd, VIDIOC_S_CTRL, &ctrl))
+		throw std::runtime_error("VIDIOC_S_CTRL: " + std::string(strerror(errno)));
+}
+
+enum cx88sdr_fmt {
+	FMT_NATIVE,	/* U8 or S16, the ring samples as they are */
+	FMT_CF32,
+	FMT_CS16,
+	FMT_CS8,
+	FMT_CU8,
+};
+
+class SoapyCX88SDR : public SoapySDR::Device
+{
+public:
+	explicit SoapyCX88SDR(const SoapySDR::Kwargs &args);
+	~SoapyCX88SDR(void);
+
+	/* Identification */
+	std::string getDriverKey(void) const { return "cx88_sdr"; }
+	std::string getHardwareKey(void) const { return card; }
+	SoapySDR::Kwargs getHardwareInfo(void) const;
+
+	size_t getNumChannels(const int dir) const
+	{
+		return (dir == SOAPY_SDR_RX) ? 1 : 0;
+	}
+
+	/* Stream */
+	std::vector<std::string> getStreamFormats(const int dir,
+						  const size_t channel) const;
+	std::string getNativeStreamFormat(const int dir, const size_t channel,
+					  double &fullScale) const;
+	SoapySDR::Stream *setupStream(const int dir, const std::string &format,
+				      const std::vector<size_t> &channels,
+				      const SoapySDR::Kwargs &args);
+	void closeStream(SoapySDR::Stream *stream);
+	size_t getStreamMTU(SoapySDR::Stream *stream) const;
+	int activateStream(SoapySDR::Stream *stream, const int flags,
+			   const long long timeNs, const size_t numElems);
+	int deactivateStream(SoapySDR::Stream *stream, const int flags,
+			     const long long timeNs);
+	int readStream(SoapySDR::Stream *stream, void * const *buffs,
+		       const size_t numElems, int &flags, long long &timeNs,
+		       const long timeoutUs);
+
+	/* Direct buffer access, native real format only */
+	size_t getNumDirectAccessBuffers(SoapySDR::Stream *stream);
+	int getDirectAccessBufferAddrs(SoapySDR::Stream *stream,
+				       const size_t handle, void **buffs);
+	int acquireReadBuffer(SoapySDR::Stream *stream, size_t &handle,
+			      const void **buffs, int &flags, long long &timeNs,
+			      const long timeoutUs);
+	void releaseReadBuffer(SoapySDR::Stream *stream, const size_t handle);
+
+	/* Antenna, the inputs of the card */
+	std::vector<std::string> listAntennas(const int dir,
+					      const size_t channel) const;
+	void setAntenna(const int dir, const size_t channel,
+			const std::string &name);
+	std::string getAntenna(const int dir, const size_t channel) const;
+
+	/* Gain */
+	std::vector<std::string> listGains(const int dir,
+					   const size_t channel) const;
+	void setGain(const int dir, const size_t channel, const double value);
+	void setGain(const int dir, const size_t channel,
+		     const std::string &name, const double value);
+	double getGain(const int dir, const size_t channel) const;
+	double getGain(const int dir, const size_t channel,
+		       const std::string &name) const;
+	SoapySDR::Range getGainRange(const int dir, const size_t channel) const;
+	SoapySDR::Range getGainRange(const int dir, const size_t channel,
+				     const std::string &name) const;
+
+	/* Frequency, the card has no tuner and samples the baseband */
+	std::vector<std::string> listFrequencies(const int dir,
+						 const size_t channel) const;
+	void setFrequency(const int dir, const size_t channel,
+			  const std::string &name, const double frequency,
+			  const SoapySDR::Kwargs &args);
+	double getFrequency(const int dir, const size_t channel,
+			    const std::string &name) const;
+	SoapySDR::RangeList getFrequencyRange(const int dir,
+					      const size_t channel,
+					      const std::string &name) const;
+
+	/* Sample rate */
+	std::vector<double> listSampleRates(const int dir,
+					    const size_t channel) const;
+	void setSampleRate(const int dir, const size_t channel,
+			   const double rate);
+	double getSampleRate(const int dir, const size_t channel) const;
+
+	/* Time, the driver timestamps are CLOCK_MONOTONIC */
+	bool hasHardwareTime(const std::string &what) const
+	{
+		return what.empty();
+	}
+	long long getHardwareTime(const std::string &what) const;
+
+	/* Settings */
+	SoapySDR::ArgInfoList getSettingInfo(void) const;
+	void writeSetting(const std::string &key, const std::string &value);
+	std::string readSetting(const std::string &key) const;
+
+private:
+	int rate_index(void) const
+	{
+		return cx88sdr_ctrl_get(fd, V4L2_CID_CX88SDR_RATE);
+	}
+	size_t sample_size(void) const
+	{
+		return cx88sdr_rates[rate_index()].sample_size;
+	}
+	std::string native_format(void) const
+	{
+		return (sample_size() == 2) ? SOAPY_SDR_S16 : SOAPY_SDR_U8;
+	}
+	void rate_select(double rate, int bits);
+	int segments_wait(long timeoutUs);
+	long long pos_time(int64_t pos);
+	void convert(void *dst, const char *src, size_t n) const;
+	void release_pos(int64_t pos);
+
+	int fd;
+	std::string path;
+	std::string card;
+	std::string bus_info;
+	char *ring;
+	uint32_t ring_size;
+	uint32_t page_size;
+
+	/* Stream state, captured by activateStream() */
+	std::string format;
+	enum cx88sdr_fmt kind;
+	size_t elem_size;
+	size_t sample;
+	double hz;
+	int bits;
+	struct cx88sdr_segments segs;
+	int64_t acquired_end;
+};
+
+SoapyCX88SDR::SoapyCX88SDR(const SoapySDR::Kwargs &args) :
+	fd(-1), ring(nullptr), ring_size(0), page_size(0), kind(FMT_NATIVE),
+	elem_size(0), sample(1), hz(0.0), bits(8), acquired_end(-1)
+{
+	struct v4l2_capability cap = {};
+	struct cx88sdr_ring r = {};
+	void *map;
+
+	if (args.count("device") == 0)
+		throw std::runtime_error("cx88_sdr: no device given");
+	path = args.at("device");
+
+	fd = open(path.c_str(), O_RDWR | O_NONBLOCK);
+	if (fd < 0)
+		throw std::runtime_error(path + ": " + strerror(errno));
+	if (ioctl(fd, VIDIOC_QUERYCAP, &cap) || ioctl(fd, CX88SDR_IOC_G_RING, &r)) {
+		close(fd);
+		throw std::runtime_error(path + ": not a cx88_sdr device");
+	}
+	card = reinterpret_cast<const char *>(cap.card);
+	bus_info = reinterpret_cast<const char *>(cap.bus_info);
+
+	map = mmap(nullptr, r.size, PROT_READ, MAP_SHARED, fd, r.mmap_offset);
+	if (map == MAP_FAILED) {
+		close(fd);
+		throw std::runtime_error(path + ": mmap: " + strerror(errno));
+	}
+	ring = static_cast<char *>(map);
+	ring_size = r.size;
+	page_size = r.page_size;
+	bits = cx88sdr_rates[rate_index()].sample_size * 8;
+
+	SoapySDR_logf(SOAPY_SDR_INFO, "cx88_sdr: %s %s, %u KiB ring",
+		      path.c_str(), bus_info.c_str(), ring_size >> 10);
+}
+
+SoapyCX88SDR::~SoapyCX88SDR(void)
+{
+	munmap(ring, ring_size);
+	close(fd);
+}
+
+SoapySDR::Kwargs SoapyCX88SDR::getHardwareInfo(void) const
+{
+	SoapySDR::Kwargs info;
+
+	info["device"] = path;
+	info["bus_info"] = bus_info;
+	info["ring_size"] = std::to_string(ring_size);
+	return info;
+}
+
+/*
+ * Stream
+ */
+
+std::vector<std::string> SoapyCX88SDR::getStreamFormats(const int dir,
+							const size_t channel) const
+{
+	return { SOAPY_SDR_CF32, SOAPY_SDR_CS16, SOAPY_SDR_CS8, SOAPY_SDR_CU8,
+		 native_format() };
+}
+
+/* The card samples a real signal, the native formats are real */
+std::string SoapyCX88SDR::getNativeStreamFormat(const int dir,
+						const size_t channel,
+						double &fullScale) const
+{
+	fullScale = (sample_size() == 2) ? 32768.0 : 128.0;
+	return native_format();
+}
+
+SoapySDR::Stream *SoapyCX88SDR::setupStream(const int dir,
+					    const std::string &fmt,
+					    const std::vector<size_t> &channels,
+					    const SoapySDR::Kwargs &args)
+{
+	if (dir != SOAPY_SDR_RX)
+		throw std::runtime_error("cx88_sdr: RX only");
+	if ((channels.size() > 1) || (!channels.empty() && channels[0]))
+		throw std::runtime_error("cx88_sdr: only channel 0");
+	if ((fmt != SOAPY_SDR_CF32) && (fmt != SOAPY_SDR_CS16) &&
+	    (fmt != SOAPY_SDR_CS8) && (fmt != SOAPY_SDR_CU8) &&
+	    (fmt != SOAPY_SDR_S16) && (fmt != SOAPY_SDR_U8))
+		throw std::runtime_error("cx88_sdr: unsupported format " + fmt);
+
+	format = fmt;
+	if (fmt == SOAPY_SDR_CF32)
+		kind = FMT_CF32;
+	else if (fmt == SOAPY_SDR_CS16)
+		kind = FMT_CS16;
+	else if (fmt == SOAPY_SDR_CS8)
+		kind = FMT_CS8;
+	else if (fmt == SOAPY_SDR_CU8)
+		kind = FMT_CU8;
+	else
+		kind = FMT_NATIVE;
+	elem_size = SoapySDR::formatToSize(fmt);
+	return reinterpret_cast<SoapySDR::Stream *>(this);
+}
+
+void SoapyCX88SDR::closeStream(SoapySDR::Stream *stream)
+{
+	format.clear();
+}
+
+size_t SoapyCX88SDR::getStreamMTU(SoapySDR::Stream *stream) const
+{
+	return CX88SDR_MTU_PAGES * page_size / sample_size();
+}
+
+/*
+ * The DMA engine runs while the device is open, start at the live samples.
+ * The rate is read here, a rate change of another width while streaming is
+ * not followed.
+ */
+int SoapyCX88SDR::activateStream(SoapySDR::Stream *stream, const int flags,
+				 const long long timeNs, const size_t numElems)
+{
+	int idx = rate_index();
+
+	sample = cx88sdr_rates[idx].sample_size;
+	hz = cx88sdr_rates[idx].hz;
+	if (((format == SOAPY_SDR_S16) && (sample != 2)) ||
+	    ((format == SOAPY_SDR_U8) && (sample != 1)))
+		return SOAPY_SDR_NOT_SUPPORTED;
+
+	acquired_end = -1;
+	if (ioctl(fd, CX88SDR_IOC_G_SEGMENTS, &segs))
+		return SOAPY_SDR_STREAM_ERROR;
+	if (segs.count)
+		release_pos(segs.seg[segs.count - 1].pos +
+			    segs.seg[segs.count - 1].length);
+	return 0;
+}
+
+int SoapyCX88SDR::deactivateStream(SoapySDR::Stream *stream, const int flags,
+				   const long long timeNs)
+{
+	return 0;
+}
+
+void SoapyCX88SDR::release_pos(int64_t pos)
+{
+	if (ioctl(fd, CX88SDR_IOC_RELEASE, &pos))
+		SoapySDR_logf(SOAPY_SDR_ERROR, "CX88SDR_IOC_RELEASE: %s",
+			      strerror(errno));
+}
+
+/*
+ * Get the ready segments, waiting for them up to timeoutUs. Returns 0, a
+ * SoapySDR error code, or SOAPY_SDR_OVERFLOW once if the card has
+ * overwritten unread samples.
+ */
+int SoapyCX88SDR::segments_wait(long timeoutUs)
+{
+	struct pollfd pfd = {};
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (ioctl(fd, CX88SDR_IOC_G_SEGMENTS, &segs))
+		return SOAPY_SDR_STREAM_ERROR;
+	if (!segs.count && !segs.overrun) {
+		if (poll(&pfd, 1, (timeoutUs + 999) / 1000) < 0)
+			return (errno == EINTR) ? SOAPY_SDR_TIMEOUT :
+						  SOAPY_SDR_STREAM_ERROR;
+		if (ioctl(fd, CX88SDR_IOC_G_SEGMENTS, &segs))
+			return SOAPY_SDR_STREAM_ERROR;
+	}
+	if (segs.overrun) {
+		SoapySDR_log(SOAPY_SDR_SSI, "O");
+		return SOAPY_SDR_OVERFLOW;
+	}
+	if (!segs.count)
+		return SOAPY_SDR_TIMEOUT;
+	return 0;
+}
+
+/* Time of the sample at a read() position, from the last RISC interrupt */
+long long SoapyCX88SDR::pos_time(int64_t pos)
+{
+	struct cx88sdr_timestamps t;
+	const struct cx88sdr_timestamp *e;
+
+	if (ioctl(fd, CX88SDR_IOC_G_TIMESTAMPS, &t) || !t.count)
+		return -1;
+	e = &t.entry[t.count - 1];
+	return (long long)e->timestamp_ns +
+	       (long long)((double)(pos - e->pos) / sample * 1e9 / hz);
+}
+
+/* Native sample i widened to s16 */
+static inline int16_t cx88sdr_load(const uint8_t *src, size_t i, size_t sample)
+{
+	if (sample == 2)
+		return (int16_t)(src[2 * i] | (src[2 * i + 1] << 8));
+	return (int16_t)((src[i] ^ 0x80) << 8);
+}
+
+/*
+ * Native samples to the stream format, complex formats get a zero Q. One
+ * loop per format, so the format is not looked at per sample.
+ */
+void SoapyCX88SDR::convert(void *dst, const char *src, size_t n) const
+{
+	const uint8_t *s = reinterpret_cast<const uint8_t *>(src);
+	size_t i;
+
+	switch (kind) {
+	case FMT_NATIVE:
+		memcpy(dst, src, n * sample);
+		break;
+	case FMT_CF32: {
+		float *d = static_cast<float *>(dst);
+
+		for (i = 0; i < n; i++) {
+			d[2 * i] = cx88sdr_load(s, i, sample) / 32768.0f;
+			d[2 * i + 1] = 0.0f;
+		}
+		break;
+	}
+	case FMT_CS16: {
+		int16_t *d = static_cast<int16_t *>(dst);
+
+		for (i = 0; i < n; i++) {
+			d[2 * i] = cx88sdr_load(s, i, sample);
+			d[2 * i + 1] = 0;
+		}
+		break;
+	}
+	case FMT_CS8: {
+		int8_t *d = static_cast<int8_t *>(dst);
+
+		for (i = 0; i < n; i++) {
+			d[2 * i] = (int8_t)(cx88sdr_load(s, i, sample) >> 8);
+			d[2 * i + 1] = 0;
+		}
+		break;
+	}
+	case FMT_CU8: {
+		uint8_t *d = static_cast<uint8_t *>(dst);
+
+		for (i = 0; i < n; i++) {
+			d[2 * i] = (uint8_t)((cx88sdr_load(s, i, sample) >> 8) ^ 0x80);
+			d[2 * i + 1] = 0x80;
+		}
+		break;
+	}
+	}
+}
+
+int SoapyCX88SDR::readStream(SoapySDR::Stream *stream, void * const *buffs,
+			     const size_t numElems, int &flags,
+			     long long &timeNs, const long timeoutUs)
+{
+	char *dst = static_cast<char *>(buffs[0]);
+	size_t done = 0;
+	uint32_t i;
+	int ret;
+
+	ret = segments_wait(timeoutUs);
+	if (ret)
+		return ret;
+
+	flags = 0;
+	timeNs = pos_time(segs.pos);
+	if (timeNs >= 0)
+		flags |= SOAPY_SDR_HAS_TIME;
+
+	for (i = 0; (i < segs.count) && (done < numElems); i++) {
+		size_t n = std::min<size_t>(segs.seg[i].length / sample,
+					    numElems - done);
+
+		convert(dst + done * elem_size, ring + segs.seg[i].offset, n);
+		done += n;
+	}
+	release_pos(segs.pos + (int64_t)(done * sample));
+	return (int)done;
+}
+
+/*
+ * Direct buffer access
+ *
+ * The handles are ring pages, a buffer starts at the read() position and
+ * runs up to the end of the first ready segment, at most one MTU. Only one
+ * buffer can be acquired at a time, releasing it consumes its samples.
+ */
+
+size_t SoapyCX88SDR::getNumDirectAccessBuffers(SoapySDR::Stream *stream)
+{
+	return ring_size / page_size;
+}
+
+int SoapyCX88SDR::getDirectAccessBufferAddrs(SoapySDR::Stream *stream,
+					     const size_t handle, void **buffs)
+{
+	buffs[0] = ring + handle * page_size;
+	return 0;
+}
+
+int SoapyCX88SDR::acquireReadBuffer(SoapySDR::Stream *stream, size_t &handle,
+				    const void **buffs, int &flags,
+				    long long &timeNs, const long timeoutUs)
+{
+	size_t n;
+	int ret;
+
+	if ((kind != FMT_NATIVE) || (acquired_end >= 0))
+		return SOAPY_SDR_NOT_SUPPORTED;
+
+	ret = segments_wait(timeoutUs);
+	if (ret)
+		return ret;
+
+	n = std::min<size_t>(segs.seg[0].length / sample,
+			     getStreamMTU(stream));
+	handle = segs.seg[0].offset / page_size;
+	buffs[0] = ring + segs.seg[0].offset;
+	flags = 0;
+	timeNs = pos_time(segs.pos);
+	if (timeNs >= 0)
+		flags |= SOAPY_SDR_HAS_TIME;
+	acquired_end = segs.pos + (int64_t)(n * sample);
+	return (int)n;
+}
+
+void SoapyCX88SDR::releaseReadBuffer(SoapySDR::Stream *stream,
+				     const size_t handle)
+{
+	if (acquired_end < 0)
+		return;
+	release_pos(acquired_end);
+	acquired_end = -1;
+}
+
+/*
+ * Antenna
+ */
+
+std::vector<std::string> SoapyCX88SDR::listAntennas(const int dir,
+						    const size_t channel) const
+{
+	return { "Input 1", "Input 2", "Input 3", "Input 4" };
+}
+
+void SoapyCX88SDR::setAntenna(const int dir, const size_t channel,
+			      const std::string &name)
+{
+	std::vector<std::string> names = listAntennas(dir, channel);
+	auto it = std::find(names.begin(), names.end(), name);
+
+	if (it == names.end())
+		throw std::runtime_error("cx88_sdr: unknown antenna " + name);
+	cx88sdr_ctrl_set(fd, V4L2_CID_CX88SDR_INPUT, (int)(it - names.begin()));
+}
+
+std::string SoapyCX88SDR::getAntenna(const int dir, const size_t channel) const
+{
+	return listAntennas(dir, channel).at(cx88sdr_ctrl_get(fd, V4L2_CID_CX88SDR_INPUT));
+}
+
+/*
+ * Gain
+ */
+
+std::vector<std::string> SoapyCX88SDR::listGains(const int dir,
+						 const size_t channel) const
+{
+	return { "AGC" };
+}
+
+void SoapyCX88SDR::setGain(const int dir, const size_t channel,
+			   const double value)
+{
+	setGain(dir, channel, "AGC", value);
+}
+
+void SoapyCX88SDR::setGain(const int dir, const size_t channel,
+			   const std::string &name, const double value)
+{
+	SoapySDR::Range r = getGainRange(dir, channel, name);
+
+	cx88sdr_ctrl_set(fd, V4L2_CID_GAIN,
+			 (int)(std::max(r.minimum(), std::min(value, r.maximum())) + 0.5));
+}
+
+double SoapyCX88SDR::getGain(const int dir, const size_t channel) const
+{
+	return getGain(dir, channel, "AGC");
+}
+
+double SoapyCX88SDR::getGain(const int dir, const size_t channel,
+			     const std::string &name) const
+{
+	return cx88sdr_ctrl_get(fd, V4L2_CID_GAIN);
+}
+
+SoapySDR::Range SoapyCX88SDR::getGainRange(const int dir,
+					   const size_t channel) const
+{
+	return getGainRange(dir, channel, "AGC");
+}
+
+SoapySDR::Range SoapyCX88SDR::getGainRange(const int dir,
+					   const size_t channel,
+					   const std::string &name) const
+{
+	struct v4l2_queryctrl q = {};
+
+	q.id = V4L2_CID_GAIN;
+	if (ioctl(fd, VIDIOC_QUERYCTRL, &q))
+		return SoapySDR::Range(0, 31, 1);
+	return SoapySDR::Range(q.minimum, q.maximum, q.step);
+}
+
+/*
+ * Frequency
+ */
+
+std::vector<std::string> SoapyCX88SDR::listFrequencies(const int dir,
+						       const size_t channel) const
+{
+	return { "RF" };
+}
+
+void SoapyCX88SDR::setFrequency(const int dir, const size_t channel,
+				const std::string &name, const double frequency,
+				const SoapySDR::Kwargs &args)
+{
+}
+
+double SoapyCX88SDR::getFrequency(const int dir, const size_t channel,
+				  const std::string &name) const
+{
+	return 0.0;
+}
+
+SoapySDR::RangeList SoapyCX88SDR::getFrequencyRange(const int dir,
+						    const size_t channel,
+						    const std::string &name) const
+{
+	return { SoapySDR::Range(0.0, 0.0) };
+}
+
+/*
+ * Sample rate
+ */
+
+std::vector<double> SoapyCX88SDR::listSampleRates(const int dir,
+						  const size_t channel) const
+{
+	std::vector<double> rates;
+	size_t i;
+
+	for (i = 0; i < CX88SDR_RATE_NUM; i++) {
+		if (std::find(rates.begin(), rates.end(), cx88sdr_rates[i].hz) ==
+		    rates.end())
+			rates.push_back(cx88sdr_rates[i].hz);
+	}
+	std::sort(rates.begin(), rates.end());
+	return rates;
+}
+
+/* Nearest rate, of the preferred width when the card has it at both */
+void SoapyCX88SDR::rate_select(double rate, int width)
+{
+	size_t i, best = 0;
+
+	for (i = 1; i < CX88SDR_RATE_NUM; i++) {
+		double d = std::abs(cx88sdr_rates[i].hz - rate);
+		double b = std::abs(cx88sdr_rates[best].hz - rate);
+
+		if ((d < b) ||
+		    ((d == b) && ((int)cx88sdr_rates[i].sample_size * 8 == width)))
+			best = i;
+	}
+	cx88sdr_ctrl_set(fd, V4L2_CID_CX88SDR_RATE, (int)best);
+}
+
+void SoapyCX88SDR::setSampleRate(const int dir, const size_t channel,
+				 const double rate)
+{
+	rate_select(rate, bits);
+}
+
+double SoapyCX88SDR::getSampleRate(const int dir, const size_t channel) const
+{
+	return cx88sdr_rates[rate_index()].hz;
+}
+
+long long SoapyCX88SDR::getHardwareTime(const std::string &what) const
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Settings
+ */
+
+SoapySDR::ArgInfoList SoapyCX88SDR::getSettingInfo(void) const
+{
+	SoapySDR::ArgInfo info;
+
+	info.key = "bits";
+	info.value = "8";
+	info.name = "Sample width";
+	info.description = "Width used at 14.318182 MHz, the only rate the card has at both";
+	info.type = SoapySDR::ArgInfo::STRING;
+	info.options = { "8", "16" };
+	return { info };
+}
+
+void SoapyCX88SDR::writeSetting(const std::string &key, const std::string &value)
+{
+	if (key != "bits")
+		return;
+	bits = (value == "16") ? 16 : 8;
+	rate_select(getSampleRate(SOAPY_SDR_RX, 0), bits);
+}
+
+std::string SoapyCX88SDR::readSetting(const std::string &key) const
+{
+	if (key == "bits")
+		return std::to_string(cx88sdr_rates[rate_index()].sample_size * 8);
+	return "";
+}
+
+/*
+ * Registration
+ */
+
+/* First line of a sysfs file, empty if it can't be read */
+static std::string cx88sdr_sysfs_read(const std::string &path)
+{
+	std::string line;
+	char buf[256];
+	FILE *f = fopen(path.c_str(), "r");
+
+	if (!f)
+		return line;
+	if (fgets(buf, sizeof(buf), f))
+		line = buf;
+	fclose(f);
+	if (!line.empty() && (line.back() == '\n'))
+		line.pop_back();
+	return line;
+}
+
+/* Last component of the target of a sysfs link */
+static std::string cx88sdr_sysfs_link(const std::string &path)
+{
+	char buf[PATH_MAX];
+	ssize_t len = readlink(path.c_str(), buf, sizeof(buf) - 1);
+	const char *base;
+
+	if (len < 0)
+		return "";
+	buf[len] = '\0';
+	base = strrchr(buf, '/');
+	return base ? base + 1 : buf;
+}
+
+/*
+ * The cards are found through sysfs, an open() of the device would allocate
+ * the ring and start the DMA engine of every card on each enumeration.
+ */
+static SoapySDR::KwargsList cx88sdr_find(const SoapySDR::Kwargs &args)
+{
+	SoapySDR::KwargsList results;
+	glob_t g;
+	size_t i;
+
+	if (glob("/sys/class/video4linux/swradio*", 0, nullptr, &g))
+		return results;
+
+	for (i = 0; i < g.gl_pathc; i++) {
+		std::string sys = g.gl_pathv[i];
+		std::string node = sys.substr(sys.rfind('/') + 1);
+		std::string path = "/dev/" + node;
+		SoapySDR::Kwargs dev;
+
+		if (args.count("device") && (args.at("device") != path))
+			continue;
+		if (cx88sdr_sysfs_link(sys + "/device/driver") != "cx88_sdr")
+			continue;
+		dev["driver"] = "cx88_sdr";
+		dev["device"] = path;
+		/* As the bus_info of VIDIOC_QUERYCAP */
+		dev["serial"] = "PCI:" + cx88sdr_sysfs_link(sys + "/device");
+		dev["label"] = CX88SDR_CARD_NAME " " + path;
+		results.push_back(dev);
+	}
+	globfree(&g);
+	return results;
+}
+
+static SoapySDR::Device *cx88sdr_make(const SoapySDR::Kwargs &args)
+{
+	return new SoapyCX88SDR(args);
+}
+
+static SoapySDR::Registry cx88sdr_registry("cx88_sdr", &cx88sdr_find,
+					   &cx88sdr_make, SOAPY_SDR_ABI_VERSION);
@@ -21,13 +21,23 @@
 #ifndef CX88SDR_H
 #define CX88SDR_H
 
+#include <linux/atomic.h>
+#include <linux/sizes.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
 #include <media/v4l2-ctrls.h>
 #include <media/v4l2-device.h>
+#include <media/videobuf2-v4l2.h>
+
+#include "cx88_sdr_uapi.h"
 
 #define	CX88SDR_DRV_NAME		"CX2388x SDR"
-#define	CX88SDR_MAX_CARDS		32
+
+/* Idle time before an unused card is powered down */
+#define CX88SDR_AUTOSUSPEND_MS		1000
 
 #define INTERRUPT_MASK			0x018888
+#define VID_INT_VBI_RISCI1		(1 << 3) // IRQ1 bit in a VBI RISC instruction
 
 #define MO_DEV_CNTRL2			0x200034 // Device control
 #define MO_PCI_INTMSK			0x200040 // PCI interrupt mask
@@ -37,6 +47,7 @@
 #define MO_DMA24_CNT1			0x30010c // {11}RW* DMA Buffer Size : Ch#24
 #define MO_DMA24_CNT2			0x30014c // {11}RW* DMA Table Size : Ch#24
 #define MO_VBI_GPCNT			0x31c02c // {16}RO VBI general purpose counter
+#define MO_VBI_GPCNTRL			0x31c03c // {2}WO VBI general purpose counter control
 #define MO_VID_DMACNTRL			0x31c040 // {8}RW Video DMA control
 #define MO_INPUT_FORMAT			0x310104
 #define MO_CONTR_BRIGHT			0x310110
@@ -68,10 +79,20 @@
 
 #define CLUSTER_BUF_NUM			8
 #define CLUSTER_BUF_SIZE		2048
+#define RISC_PACKETS_PER_PAGE		(PAGE_SIZE / CLUSTER_BUF_SIZE)
+
+/* Ring size in MiB and RISC IRQ period in pages, see the module parameters */
+#define VBI_DMA_SIZE_DEF		64
+#define VBI_DMA_SIZE_MAX		(SZ_64K / (SZ_1M >> PAGE_SHIFT)) // {16} MO_VBI_GPCNT
+#define VBI_IRQ_PAGES_DEF		512
+
+/* Largest coherent block of the DMA ring */
+#define CX88SDR_DMA_CHUNK_MAX		SZ_4M
+
+#define GP_COUNT_CONTROL_RESET		0x3
 
-#define VBI_DMA_SIZE			(64 * 1024 * 1024)
-#define VBI_DMA_PAGES			(VBI_DMA_SIZE >> PAGE_SHIFT)
-#define VBI_DMA_BUF_NUM			(VBI_DMA_SIZE / CLUSTER_BUF_SIZE)
+/* Size of a videobuf2 buffer, a whole number of ring pages */
+#define CX88SDR_VB_BUF_SIZE		(64 * PAGE_SIZE)
 
 enum {
 	VMUX_00,
@@ -89,22 +110,182 @@ enum {
 	RATE_5FSC_16BIT
 };
 
+/* Largest output sample, complex float */
+#define CX88SDR_FMT_SAMPLE_MAX		8
+
+struct cx88sdr_format {
+	u32				pixelformat;
+	const char			*name;
+	u32				sample_size;
+};
+
+/* Half-band decimate by 2 stages, up to decimate by 8 */
+#define CX88SDR_HB_STAGES		3
+#define CX88SDR_HB_TAPS			11
+
+struct cx88sdr_hb {
+	s16				hist[CX88SDR_HB_TAPS - 1];
+	u32				phase;
+};
+
+/* Conversion state of a reader */
+struct cx88sdr_dsp {
+	s16				*work;
+	s16				*hb_buf;
+	struct	cx88sdr_hb		hb[CX88SDR_HB_STAGES];
+	void				*out;
+	size_t				out_len;
+	size_t				out_off;
+};
+
+/* Rate and format of one conversion, read once so a control can't skew it */
+struct cx88sdr_conv {
+	bool				in_16bit;
+	u32				decimation;
+	u32				pixelformat;
+	u32				out_size;
+};
+
+/* Page count and time of the last RISC IRQs */
+#define CX88SDR_TS_ENTRIES		64
+
+struct cx88sdr_ts {
+	u64				page;
+	u64				ns;
+};
+
+/*
+ * Settings changes, the new settings apply from page on. The change takes
+ * effect in the page being written and the samples still in the SRAM FIFO.
+ */
+#define CX88SDR_MARK_ENTRIES		16
+#define CX88SDR_MARK_GUARD_PAGES	(DIV_ROUND_UP(CLUSTER_BUF_NUM * \
+					 CLUSTER_BUF_SIZE, PAGE_SIZE) + 1)
+
+struct cx88sdr_mark {
+	u64				page;
+	u32				seq;
+	u32				rate;
+	u32				input;
+	u32				gain;
+};
+
+/* Signal level of the pages of one RISC IRQ period */
+#define CX88SDR_LEVEL_ENTRIES		16
+
+struct cx88sdr_level {
+	u64				page;
+	u64				ns;
+	u32				seq;
+	u32				samples;
+	u32				power;
+	u32				peak;
+	u32				clipped;
+	u32				gain;
+};
+
+struct cx88sdr_level_acc {
+	u64				start;
+	u64				sum_sq;
+	u32				samples;
+	u32				peak;
+	u32				clipped;
+};
+
+/* Auto gain, one step down past 1/16384 clipped samples, up below -12 dBFS */
+#define CX88SDR_AUTOGAIN_CLIP		16384
+#define CX88SDR_AUTOGAIN_LOW		8192
+
+struct cx88sdr_sweep_slot {
+	u32				input;
+	u32				gain;
+	u64				pages;
+};
+
+/* Registers set by the controls, cached to skip redundant writes */
+enum {
+	SHADOW_CAPTURE_CTRL,
+	SHADOW_SCONV,
+	SHADOW_PLL,
+	SHADOW_INPUT_FORMAT,
+	SHADOW_AGC_GAIN_ADJ4,
+	SHADOW_NUM
+};
+
+/* Counters shown in debugfs */
+struct cx88sdr_stats {
+	u64				irqs;
+	atomic64_t			read_bytes;
+	atomic64_t			wait_ns;
+	atomic_t			openers;
+};
+
+struct cx88sdr_dma_chunk {
+	void				*virt;
+	dma_addr_t			phy;
+	uint32_t			size;
+	uint32_t			pnum;		/* First ring page */
+};
+
 struct cx88sdr_dev {
 	struct	list_head		devlist;
 	int				irq;
 	int				nr;
 	char				name[32];
+	char				irq_name[32];
+	uint32_t			vid_intmsk;
+	atomic_t			irq_status;
 
 	/* IO */
 	struct	pci_dev			*pdev;
 	dma_addr_t			risc_inst_phy;
-	dma_addr_t			pgvec_phy[VBI_DMA_PAGES + 1];
+	dma_addr_t			*pgvec_phy;
 	uint32_t	__iomem		*mmio;
 	uint32_t			risc_inst_buff_size;
 	uint32_t			*risc_inst_virt;
-	uint32_t			initial_page;
-	void				*pgvec_virt[VBI_DMA_PAGES + 1];
+	void				**pgvec_virt;
+	struct	cx88sdr_dma_chunk	*chunks;
+	uint32_t			nr_chunks;
+	uint32_t			dma_size;
+	uint32_t			dma_pages;
+	uint32_t			irq_pages;
 	int				pci_lat;
+	int				node;
+	bool				dma_streaming;
+	uint32_t			dma_guard;
+	uint32_t			dma_remote_pages;
+	wait_queue_head_t		wq;
+
+	/* DMA engine */
+	struct	mutex			dma_mlock;
+	int				dma_users;
+	int				intr_users;
+	bool				gone;		/* Removed, the card is not touched */
+	bool				hw_ready;	/* Powered and set up, under the control lock */
+
+	/* Ring position */
+	spinlock_t			gp_lock;
+	uint32_t			gp_last;
+	u64				gp_total;
+	u64				gp_base;
+	atomic64_t			overruns;
+	atomic64_t			dropped_bytes;
+	struct	cx88sdr_ts		ts[CX88SDR_TS_ENTRIES];
+	u64				ts_seq;
+	u32				ts_count;
+	struct	cx88sdr_mark		marks[CX88SDR_MARK_ENTRIES];
+	u32				mark_seq;
+
+	/*
+	 * Streaming ring, pages below gp_synced are synced for the CPU and the
+	 * slots of the pages below gp_device are owned by the card
+	 */
+	spinlock_t			dma_sync_lock;
+	u64				gp_synced;
+	u64				gp_device;
+
+	struct	cx88sdr_stats		stats;
+	struct	dentry			*debugfs;
 
 	/* V4L2 */
 	struct	v4l2_device		v4l2_dev;
@@ -114,10 +295,46 @@ struct cx88sdr_dev {
 	u32				gain;
 	u32				input;
 	u32				rate;
+	u32				decimation;
+	uint32_t			shadow[SHADOW_NUM];
+	uint32_t			shadow_valid;
+	struct	v4l2_ctrl		*ctrl_gain;
+	struct	v4l2_ctrl		*ctrl_input;
+
+	/* Input and gain sweep, stepped by the IRQ thread */
+	struct	mutex			sweep_mlock;
+	struct	cx88sdr_sweep_slot	sweep[CX88SDR_SWEEP_MAX];
+	u32				sweep_count;
+	u32				sweep_idx;
+	u64				sweep_next;
 
-	/* V4L2 SDR */
+	/* Signal levels, measured by the IRQ thread */
+	struct	cx88sdr_level		levels[CX88SDR_LEVEL_ENTRIES];
+	u32				level_seq;
+	struct	cx88sdr_level_acc	level_acc;
+	u64				level_page;
+	bool				level_run;
+	u32				levels_on;
+	u32				autogain;
+	u64				autogain_next;
+
+	/* V4L2 SDR, pixelformat is 0 until set, then samples are converted */
 	u32				pixelformat;
 	u32				buffersize;
+
+	/* videobuf2 */
+	struct	vb2_queue		vb_queue;
+	struct	list_head		vb_queued;
+	spinlock_t			vb_lock;
+	bool				vb_streaming;
+	u64				vb_page;
+	unsigned int			sequence;
+	struct	cx88sdr_dsp		vb_dsp;
+};
+
+struct cx88sdr_buf {
+	struct	vb2_v4l2_buffer		vb;
+	struct	list_head		list;
 };
 
 /* Helpers */
@@ -131,18 +348,81 @@ static inline void mmio_iowrite32(struct cx88sdr_dev *dev, uint32_t reg, uint32_
 	iowrite32((val), dev->mmio + ((reg) >> 2));
 }
 
+static inline bool cx88sdr_rate_16bit(struct cx88sdr_dev *dev)
+{
+	return dev->rate >= RATE_2FSC_16BIT;
+}
+
+/* Format of the samples written by the card at the current rate */
+static inline u32 cx88sdr_native_format(struct cx88sdr_dev *dev)
+{
+	return cx88sdr_rate_16bit(dev) ? CX88SDR_FMT_RS16LE : CX88SDR_FMT_RU8;
+}
+
+static inline u32 cx88sdr_pixelformat(struct cx88sdr_dev *dev)
+{
+	return dev->pixelformat ? dev->pixelformat : cx88sdr_native_format(dev);
+}
+
 #define cx88sdr_pr_info(fmt, ...)	pr_info(KBUILD_MODNAME " %s: " fmt,		\
 						pci_name(dev->pdev), ##__VA_ARGS__)
 #define cx88sdr_pr_err(fmt, ...)	pr_err(KBUILD_MODNAME " %s: " fmt,		\
 						pci_name(dev->pdev), ##__VA_ARGS__)
 
+/* cx88sdr_core.c */
+u64 cx88sdr_gp_sync(struct cx88sdr_dev *dev);
+u32 cx88sdr_ts_get(struct cx88sdr_dev *dev, struct cx88sdr_ts *ts, u32 max);
+u64 cx88sdr_ts_lookup(struct cx88sdr_dev *dev, u64 page);
+void cx88sdr_mark(struct cx88sdr_dev *dev);
+u32 cx88sdr_marks_get(struct cx88sdr_dev *dev, struct cx88sdr_mark *marks,
+		      u32 max);
+void cx88sdr_level_add(struct cx88sdr_dev *dev, struct cx88sdr_level *lvl);
+u32 cx88sdr_levels_get(struct cx88sdr_dev *dev, struct cx88sdr_level *levels,
+		       u32 max);
+int cx88sdr_dma_get(struct cx88sdr_dev *dev);
+void cx88sdr_dma_put(struct cx88sdr_dev *dev);
+u64 cx88sdr_gp_base(struct cx88sdr_dev *dev);
+int cx88sdr_sync_start(struct cx88sdr_sync_start *sync);
+void cx88sdr_intr_get(struct cx88sdr_dev *dev);
+void cx88sdr_intr_put(struct cx88sdr_dev *dev);
+
+struct seq_file;
+
+/* cx88sdr_debugfs.c */
+void cx88sdr_debugfs_init(void);
+void cx88sdr_debugfs_exit(void);
+void cx88sdr_debugfs_add(struct cx88sdr_dev *dev);
+void cx88sdr_debugfs_remove(struct cx88sdr_dev *dev);
+
+/* cx88sdr_dsp.c */
+const struct cx88sdr_format *cx88sdr_format_enum(unsigned int index);
+const struct cx88sdr_format *cx88sdr_format_find(u32 pixelformat);
+int cx88sdr_dsp_init(struct cx88sdr_dsp *dsp, int node);
+void cx88sdr_dsp_free(struct cx88sdr_dsp *dsp);
+void cx88sdr_dsp_conv_get(struct cx88sdr_dev *dev, struct cx88sdr_conv *conv);
+size_t cx88sdr_dsp_out_max(const struct cx88sdr_conv *conv, size_t len);
+size_t cx88sdr_dsp_convert(struct cx88sdr_dsp *dsp,
+			   const struct cx88sdr_conv *conv,
+			   void *dst, const void *src, size_t len);
+void cx88sdr_dsp_levels(struct cx88sdr_dev *dev, struct cx88sdr_level_acc *acc,
+			const void *src, size_t len);
+
 /* cx88sdr_v4l2.c */
 extern const struct v4l2_ctrl_ops cx88sdr_ctrl_ops;
 extern const struct v4l2_ctrl_config cx88sdr_ctrl_input;
 extern const struct v4l2_ctrl_config cx88sdr_ctrl_rate;
+extern const struct v4l2_ctrl_config cx88sdr_ctrl_decimation;
+extern const struct v4l2_ctrl_config cx88sdr_ctrl_levels;
 extern const struct video_device cx88sdr_template;
+extern const struct vb2_ops cx88sdr_vb2_ops;
 
+void cx88sdr_vb_fill(struct cx88sdr_dev *dev);
+void cx88sdr_levels_update(struct cx88sdr_dev *dev);
+void cx88sdr_readers_show(struct cx88sdr_dev *dev, struct seq_file *m);
 void cx88sdr_rate_set(struct cx88sdr_dev *dev);
+void cx88sdr_shadow_invalidate(struct cx88sdr_dev *dev);
+void cx88sdr_sweep_step(struct cx88sdr_dev *dev);
+void cx88sdr_sweep_clear(struct cx88sdr_dev *dev);
 void cx88sdr_agc_setup(struct cx88sdr_dev *dev);
 void cx88sdr_input_set(struct cx88sdr_dev *dev);
 
@@ -0,0 +1,653 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * cx88_sdr_bench.c - CX2388x SDR V4L2 Driver capture benchmark
+ * Copyright (c) 2020 Jorge Maidana <jorgem.seq@gmail.com>
+ *
+ * Captures from one or more cards through read(), the mmap()'d ring and
+ * streaming I/O at every sampling rate, and reports the throughput, the CPU
+ * time of the capture thread and of the IRQ thread of the card, the dropped
+ * bytes and a histogram of the wakeup latency, measured
+ * from the RISC interrupt to the return to user space. The ring mapping in
+ * use, the dma_mode parameter of the module, is shown with each result.
+ * Every run uses the native format without decimation, the rate, format and
+ * decimation found at start are restored at exit.
+ *
+ * make bench
+ * ./cx88_sdr_bench [-t seconds] [-r rates] [-m modes] [-c] /dev/swradioN...
+ */
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "cx88_sdr_uapi.h"
+
+#define BENCH_MAX_DEVS		32
+#define BENCH_VB_BUFS		16
+#define BENCH_HIST_BUCKETS	24
+#define BENCH_IRQ_THREADS	4
+
+enum {
+	MODE_READ,
+	MODE_MMAP,
+	MODE_VB2,
+	MODE_NUM
+};
+
+static const char * const mode_names[MODE_NUM] = {
+	[MODE_READ]	= "read",
+	[MODE_MMAP]	= "mmap",
+	[MODE_VB2]	= "vb2",
+};
+
+static const struct cx88sdr_rate rates[CX88SDR_RATE_NUM] = CX88SDR_RATES;
+
+#define RATE_NUM	CX88SDR_RATE_NUM
+
+struct bench_result {
+	uint64_t	bytes;
+	uint64_t	dropped;
+	uint64_t	wall_ns;
+	uint64_t	cpu_ns;
+	uint64_t	irq_cpu_ns;
+	uint64_t	hist[BENCH_HIST_BUCKETS];
+	uint64_t	sum;
+	int		err;
+};
+
+struct bench_dev {
+	const char		*path;
+	int			fd;
+	int			rate;
+	int			mode;
+	pthread_t		thread;
+	struct bench_result	res;
+	int			irq_pids[BENCH_IRQ_THREADS];
+	int			nr_irq_pids;
+};
+
+static int bench_seconds = 5;
+static size_t bench_read_size = 1 << 20;
+
+static char dma_mode[16] = "unknown";
+
+/* The module parameter is the same for all the cards */
+static void get_dma_mode(void)
+{
+	FILE *f = fopen("/sys/module/cx88_sdr/parameters/dma_mode", "r");
+
+	if (!f)
+		return;
+	if (fscanf(f, "%15s", dma_mode) != 1)
+		strcpy(dma_mode, "unknown");
+	fclose(f);
+}
+
+/*
+ * The IRQ thread of the card is named irq/<irq>-cx88_sdr[<nr>], cut to the
+ * 15 characters of a task name, so cards sharing an IRQ line can't be told
+ * apart and their threads are counted together.
+ */
+static void find_irq_threads(struct bench_dev *d)
+{
+	char path[64], name[32], comm[32];
+	struct dirent *de;
+	struct stat st;
+	DIR *dir;
+	FILE *f;
+	int irq;
+
+	d->nr_irq_pids = 0;
+	if (fstat(d->fd, &st))
+		return;
+	snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/device/irq",
+		 major(st.st_rdev), minor(st.st_rdev));
+	f = fopen(path, "r");
+	if (!f)
+		return;
+	if (fscanf(f, "%d", &irq) != 1)
+		irq = -1;
+	fclose(f);
+	if (irq < 0)
+		return;
+	snprintf(name, sizeof(name), "irq/%d-cx88_sdr", irq);
+	name[15] = '\0';
+
+	dir = opendir("/proc");
+	if (!dir)
+		return;
+	while ((de = readdir(dir)) && (d->nr_irq_pids < BENCH_IRQ_THREADS)) {
+		if (!isdigit((unsigned char)de->d_name[0]))
+			continue;
+		snprintf(path, sizeof(path), "/proc/%d/comm", atoi(de->d_name));
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (fgets(comm, sizeof(comm), f) &&
+		    !strncmp(comm, name, strlen(name)))
+			d->irq_pids[d->nr_irq_pids++] = atoi(de->d_name);
+		fclose(f);
+	}
+	closedir(dir);
+}
+
+/* utime + stime of the IRQ threads from /proc/<pid>/stat, in ns */
+static uint64_t irq_cpu_ns(const struct bench_dev *d)
+{
+	unsigned long long utime, stime, sum = 0;
+	char path[64], buf[512], *p;
+	long hz = sysconf(_SC_CLK_TCK);
+	FILE *f;
+	int i;
+
+	for (i = 0; i < d->nr_irq_pids; i++) {
+		snprintf(path, sizeof(path), "/proc/%d/stat", d->irq_pids[i]);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		/* The fields after the name, utime and stime are 14 and 15 */
+		if (fgets(buf, sizeof(buf), f) && (p = strrchr(buf, ')')) &&
+		    (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+			    "%llu %llu", &utime, &stime) == 2))
+			sum += utime + stime;
+		fclose(f);
+	}
+	return sum * 1000000000ull / hz;
+}
+
+static uint64_t now_ns(clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Touch the samples like a consumer would */
+static uint64_t touch(const void *buf, size_t len)
+{
+	const uint64_t *p = buf;
+	uint64_t sum = 0;
+	size_t i;
+
+	for (i = 0; i < len / sizeof(*p); i++)
+		sum += p[i];
+	return sum;
+}
+
+static void hist_add(struct bench_result *res, uint64_t irq_ns)
+{
+	uint64_t now = now_ns(CLOCK_MONOTONIC);
+	uint64_t us = (now > irq_ns) ? (now - irq_ns) / 1000 : 0;
+	int b = 0;
+
+	while ((us >> b) && (b < BENCH_HIST_BUCKETS - 1))
+		b++;
+	res->hist[b]++;
+}
+
+/* Time of the newest RISC interrupt */
+static uint64_t last_irq_ns(int fd)
+{
+	struct cx88sdr_timestamps t;
+
+	if (ioctl(fd, CX88SDR_IOC_G_TIMESTAMPS, &t) || !t.count)
+		return 0;
+	return t.entry[t.count - 1].timestamp_ns;
+}
+
+static uint64_t fh_dropped(int fd)
+{
+	struct cx88sdr_ring ring;
+
+	if (ioctl(fd, CX88SDR_IOC_G_RING, &ring))
+		return 0;
+	return ring.dropped_bytes;
+}
+
+static int bench_read(struct bench_dev *d, uint64_t end)
+{
+	struct bench_result *res = &d->res;
+	uint64_t irq_ns;
+	ssize_t ret;
+	char *buf;
+
+	buf = malloc(bench_read_size);
+	if (!buf)
+		return -ENOMEM;
+
+	while (now_ns(CLOCK_MONOTONIC) < end) {
+		ret = read(d->fd, buf, bench_read_size);
+		if (ret < 0) {
+			free(buf);
+			return -errno;
+		}
+		irq_ns = last_irq_ns(d->fd);
+		if (irq_ns)
+			hist_add(res, irq_ns);
+		res->sum += touch(buf, ret);
+		res->bytes += ret;
+	}
+	free(buf);
+	return 0;
+}
+
+static int bench_mmap(struct bench_dev *d, uint64_t end)
+{
+	struct bench_result *res = &d->res;
+	struct pollfd pfd = { .fd = d->fd, .events = POLLIN };
+	struct cx88sdr_segments s;
+	struct cx88sdr_ring ring;
+	uint64_t irq_ns;
+	int64_t pos;
+	uint32_t i;
+	char *ring_buf;
+	int ret = 0;
+
+	if (ioctl(d->fd, CX88SDR_IOC_G_RING, &ring))
+		return -errno;
+	ring_buf = mmap(NULL, ring.size, PROT_READ, MAP_SHARED, d->fd,
+			ring.mmap_offset);
+	if (ring_buf == MAP_FAILED)
+		return -errno;
+
+	while (now_ns(CLOCK_MONOTONIC) < end) {
+		if (poll(&pfd, 1, 1000) < 0) {
+			ret = -errno;
+			break;
+		}
+		if (ioctl(d->fd, CX88SDR_IOC_G_SEGMENTS, &s)) {
+			ret = -errno;
+			break;
+		}
+		if (!s.count)
+			continue;
+		irq_ns = last_irq_ns(d->fd);
+		if (irq_ns)
+			hist_add(res, irq_ns);
+		for (i = 0; i < s.count; i++) {
+			res->sum += touch(ring_buf + s.seg[i].offset,
+					  s.seg[i].length);
+			res->bytes += s.seg[i].length;
+		}
+		pos = s.seg[s.count - 1].pos + s.seg[s.count - 1].length;
+		if (ioctl(d->fd, CX88SDR_IOC_RELEASE, &pos)) {
+			ret = -errno;
+			break;
+		}
+	}
+	munmap(ring_buf, ring.size);
+	return ret;
+}
+
+static int bench_vb2(struct bench_dev *d, uint64_t end)
+{
+	struct bench_result *res = &d->res;
+	struct v4l2_requestbuffers req = {
+		.count	= BENCH_VB_BUFS,
+		.type	= V4L2_BUF_TYPE_SDR_CAPTURE,
+		.memory	= V4L2_MEMORY_MMAP,
+	};
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_SDR_CAPTURE;
+	void *bufs[BENCH_VB_BUFS] = { NULL };
+	size_t sizes[BENCH_VB_BUFS] = { 0 };
+	struct pollfd pfd = { .fd = d->fd, .events = POLLIN };
+	struct v4l2_buffer b;
+	uint32_t i, last_seq = 0;
+	int ret = 0, first = 1;
+
+	if (ioctl(d->fd, VIDIOC_REQBUFS, &req))
+		return -errno;
+	if (req.count > BENCH_VB_BUFS)
+		req.count = BENCH_VB_BUFS;
+
+	for (i = 0; i < req.count; i++) {
+		memset(&b, 0, sizeof(b));
+		b.type = type;
+		b.memory = V4L2_MEMORY_MMAP;
+		b.index = i;
+		if (ioctl(d->fd, VIDIOC_QUERYBUF, &b)) {
+			ret = -errno;
+			goto unmap;
+		}
+		bufs[i] = mmap(NULL, b.length, PROT_READ, MAP_SHARED, d->fd,
+			       b.m.offset);
+		if (bufs[i] == MAP_FAILED) {
+			bufs[i] = NULL;
+			ret = -errno;
+			goto unmap;
+		}
+		sizes[i] = b.length;
+		if (ioctl(d->fd, VIDIOC_QBUF, &b)) {
+			ret = -errno;
+			goto unmap;
+		}
+	}
+
+	if (ioctl(d->fd, VIDIOC_STREAMON, &type)) {
+		ret = -errno;
+		goto unmap;
+	}
+
+	while (now_ns(CLOCK_MONOTONIC) < end) {
+		if (poll(&pfd, 1, 1000) <= 0)
+			continue;
+		memset(&b, 0, sizeof(b));
+		b.type = type;
+		b.memory = V4L2_MEMORY_MMAP;
+		if (ioctl(d->fd, VIDIOC_DQBUF, &b)) {
+			ret = -errno;
+			break;
+		}
+		hist_add(res, (uint64_t)b.timestamp.tv_sec * 1000000000ull +
+			      b.timestamp.tv_usec * 1000ull);
+		res->sum += touch(bufs[b.index], b.bytesused);
+		res->bytes += b.bytesused;
+
+		/* Buffers that found no free slot show up as sequence gaps */
+		if (!first && (b.sequence != last_seq + 1))
+			res->dropped += (uint64_t)(b.sequence - last_seq - 1) *
+					b.bytesused;
+		last_seq = b.sequence;
+		first = 0;
+
+		if (ioctl(d->fd, VIDIOC_QBUF, &b)) {
+			ret = -errno;
+			break;
+		}
+	}
+	ioctl(d->fd, VIDIOC_STREAMOFF, &type);
+
+unmap:
+	for (i = 0; i < BENCH_VB_BUFS; i++) {
+		if (bufs[i])
+			munmap(bufs[i], sizes[i]);
+	}
+	req.count = 0;
+	ioctl(d->fd, VIDIOC_REQBUFS, &req);
+	return ret;
+}
+
+static void *bench_thread(void *arg)
+{
+	struct bench_dev *d = arg;
+	struct bench_result *res = &d->res;
+	uint64_t start, cpu, irq_cpu, dropped, end;
+
+	memset(res, 0, sizeof(*res));
+	dropped = fh_dropped(d->fd);
+	start = now_ns(CLOCK_MONOTONIC);
+	cpu = now_ns(CLOCK_THREAD_CPUTIME_ID);
+	irq_cpu = irq_cpu_ns(d);
+	end = start + (uint64_t)bench_seconds * 1000000000ull;
+
+	switch (d->mode) {
+	case MODE_READ:
+		res->err = bench_read(d, end);
+		break;
+	case MODE_MMAP:
+		res->err = bench_mmap(d, end);
+		break;
+	case MODE_VB2:
+		res->err = bench_vb2(d, end);
+		break;
+	}
+
+	res->wall_ns = now_ns(CLOCK_MONOTONIC) - start;
+	res->cpu_ns = now_ns(CLOCK_THREAD_CPUTIME_ID) - cpu;
+	res->irq_cpu_ns = irq_cpu_ns(d) - irq_cpu;
+	if (d->mode != MODE_VB2)
+		res->dropped = fh_dropped(d->fd) - dropped;
+	return NULL;
+}
+
+static int set_ctrl(int fd, uint32_t id, int value)
+{
+	struct v4l2_control ctrl = {
+		.id	= id,
+		.value	= value,
+	};
+
+	return ioctl(fd, VIDIOC_S_CTRL, &ctrl);
+}
+
+static int get_ctrl(int fd, uint32_t id)
+{
+	struct v4l2_control ctrl = { .id = id };
+
+	if (ioctl(fd, VIDIOC_G_CTRL, &ctrl))
+		return -1;
+	return ctrl.value;
+}
+
+static int set_fmt(int fd, uint32_t pixelformat)
+{
+	struct v4l2_format fmt = { .type = V4L2_BUF_TYPE_SDR_CAPTURE };
+
+	fmt.fmt.sdr.pixelformat = pixelformat;
+	return ioctl(fd, VIDIOC_S_FMT, &fmt);
+}
+
+static uint32_t get_fmt(int fd)
+{
+	struct v4l2_format fmt = { .type = V4L2_BUF_TYPE_SDR_CAPTURE };
+
+	if (ioctl(fd, VIDIOC_G_FMT, &fmt))
+		return 0;
+	return fmt.fmt.sdr.pixelformat;
+}
+
+/*
+ * The expected throughput is that of the ring, so the samples must come out
+ * as the card writes them, whatever an earlier user left set
+ */
+static int set_native(int fd, int rate)
+{
+	if (set_ctrl(fd, V4L2_CID_CX88SDR_RATE, rate) ||
+	    set_ctrl(fd, V4L2_CID_CX88SDR_DECIMATION, 0))
+		return -1;
+	return set_fmt(fd, (rates[rate].sample_size == 2) ?
+			   CX88SDR_FMT_RS16LE : CX88SDR_FMT_RU8);
+}
+
+struct bench_saved {
+	int		rate;
+	int		decimation;
+	uint32_t	pixelformat;
+};
+
+static void save_settings(int fd, struct bench_saved *saved)
+{
+	saved->rate = get_ctrl(fd, V4L2_CID_CX88SDR_RATE);
+	saved->decimation = get_ctrl(fd, V4L2_CID_CX88SDR_DECIMATION);
+	saved->pixelformat = get_fmt(fd);
+}
+
+static void restore_settings(int fd, const struct bench_saved *saved)
+{
+	if (saved->rate >= 0)
+		set_ctrl(fd, V4L2_CID_CX88SDR_RATE, saved->rate);
+	if (saved->decimation >= 0)
+		set_ctrl(fd, V4L2_CID_CX88SDR_DECIMATION, saved->decimation);
+	if (saved->pixelformat)
+		set_fmt(fd, saved->pixelformat);
+}
+
+/* Reopen so every run starts with fresh counters and at the write page */
+static int reopen(struct bench_dev *d)
+{
+	if (d->fd >= 0)
+		close(d->fd);
+	d->fd = open(d->path, O_RDWR);
+	return (d->fd < 0) ? -errno : 0;
+}
+
+static int report(struct bench_dev *d, int check)
+{
+	struct bench_result *res = &d->res;
+	double secs = res->wall_ns / 1e9;
+	double msps = rates[d->rate].hz / 1e6;
+	double mbps = res->bytes / secs / 1e6;
+	double expect = msps * rates[d->rate].sample_size;
+	double cpu = 100.0 * res->cpu_ns / res->wall_ns;
+	double irq_cpu = 100.0 * res->irq_cpu_ns / res->wall_ns;
+	int i, fail = 0;
+
+	if (res->err) {
+		printf("%s rate %d %s: error %s\n", d->path, d->rate,
+		       mode_names[d->mode], strerror(-res->err));
+		return 1;
+	}
+
+	printf("%s rate %d (%.6f MS/s, %d-bit) %s, %s ring: %.2f MB/s (%.1f%%), "
+	       "cpu %.1f%% + irq thread %.1f%% (%.3f%% per MS/s), "
+	       "dropped %llu bytes\n",
+	       d->path, d->rate, msps, (int)rates[d->rate].sample_size * 8,
+	       mode_names[d->mode], dma_mode, mbps, 100.0 * mbps / expect, cpu,
+	       d->nr_irq_pids ? irq_cpu : 0.0, (cpu + irq_cpu) / msps,
+	       (unsigned long long)res->dropped);
+	if (!d->nr_irq_pids)
+		printf("  irq thread not found, its CPU time is not counted\n");
+
+	printf("  wakeup latency:");
+	for (i = 0; i < BENCH_HIST_BUCKETS; i++) {
+		if (res->hist[i])
+			printf(" <%lluus:%llu", 1ull << i,
+			       (unsigned long long)res->hist[i]);
+	}
+	printf("\n");
+
+	/* Regression check, no drops and within 2% of the sample rate */
+	if (check && (res->dropped || (mbps < 0.98 * expect)))
+		fail = 1;
+	return fail;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-t seconds] [-b read_size] [-r rate,...] [-m mode,...] [-c] device...\n"
+		"  -t  seconds per run (default 5)\n"
+		"  -b  read() size in bytes (default 1048576)\n"
+		"  -r  rate menu indexes, 0-5 (default all)\n"
+		"  -m  read, mmap, vb2 (default all)\n"
+		"  -c  exit with 1 on drops or a throughput below 98%%\n",
+		prog);
+}
+
+static int parse_list(char *arg, int *list, int max, int mode)
+{
+	char *tok;
+	int i, n = 0;
+
+	for (tok = strtok(arg, ","); tok && n < max; tok = strtok(NULL, ",")) {
+		if (!mode) {
+			list[n++] = atoi(tok);
+			continue;
+		}
+		for (i = 0; i < MODE_NUM; i++) {
+			if (!strcmp(tok, mode_names[i]))
+				break;
+		}
+		if (i == MODE_NUM)
+			return -1;
+		list[n++] = i;
+	}
+	return n;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_dev devs[BENCH_MAX_DEVS];
+	int rate_list[RATE_NUM] = { 0, 1, 2, 3, 4, 5 };
+	int mode_list[MODE_NUM] = { MODE_READ, MODE_MMAP, MODE_VB2 };
+	int nr_rates = RATE_NUM, nr_modes = MODE_NUM;
+	int i, r, m, opt, ndevs, check = 0, fail = 0;
+	struct bench_saved saved[BENCH_MAX_DEVS];
+
+	while ((opt = getopt(argc, argv, "t:b:r:m:ch")) != -1) {
+		switch (opt) {
+		case 't':
+			bench_seconds = atoi(optarg);
+			break;
+		case 'b':
+			bench_read_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			nr_rates = parse_list(optarg, rate_list, RATE_NUM, 0);
+			break;
+		case 'm':
+			nr_modes = parse_list(optarg, mode_list, MODE_NUM, 1);
+			break;
+		case 'c':
+			check = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	get_dma_mode();
+
+	ndevs = argc - optind;
+	if ((ndevs <= 0) || (ndevs > BENCH_MAX_DEVS) || (nr_rates <= 0) ||
+	    (nr_modes <= 0) || (bench_seconds <= 0) || !bench_read_size) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	for (i = 0; i < ndevs; i++) {
+		devs[i].path = argv[optind + i];
+		devs[i].fd = -1;
+		if (reopen(&devs[i])) {
+			perror(devs[i].path);
+			return 2;
+		}
+		save_settings(devs[i].fd, &saved[i]);
+		find_irq_threads(&devs[i]);
+	}
+
+	for (r = 0; r < nr_rates; r++) {
+		if ((rate_list[r] < 0) || (rate_list[r] >= (int)RATE_NUM))
+			continue;
+		for (m = 0; m < nr_modes; m++) {
+			/* All the cards run the same test at the same time */
+			for (i = 0; i < ndevs; i++) {
+				devs[i].rate = rate_list[r];
+				devs[i].mode = mode_list[m];
+				if (reopen(&devs[i]) ||
+				    set_native(devs[i].fd, devs[i].rate)) {
+					perror(devs[i].path);
+					return 2;
+				}
+				pthread_create(&devs[i].thread, NULL,
+					       bench_thread, &devs[i]);
+			}
+			for (i = 0; i < ndevs; i++) {
+				pthread_join(devs[i].thread, NULL);
+				fail |= report(&devs[i], check);
+			}
+		}
+	}
+
+	for (i = 0; i < ndevs; i++) {
+		restore_settings(devs[i].fd, &saved[i]);
+		close(devs[i].fd);
+	}
+	return fail;
+}
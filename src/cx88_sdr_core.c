@@ -19,13 +19,21 @@
  */
 
 #include <linux/delay.h>
+#include <linux/dma-mapping.h>
+#include <linux/idr.h>
 #include <linux/interrupt.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/pci.h>
+#include <linux/pm_runtime.h>
 #include <linux/videodev2.h>
 #include <media/v4l2-dev.h>
 #include <media/v4l2-event.h>
 #include <media/v4l2-ioctl.h>
+#include <media/videobuf2-vmalloc.h>
 
 #include "cx88_sdr.h"
 
@@ -37,10 +45,32 @@ static int latency = 248;
 module_param(latency, int, 0);
 MODULE_PARM_DESC(latency, "Set PCI latency timer");
 
+static int ring_size = VBI_DMA_SIZE_DEF;
+module_param(ring_size, int, 0);
+MODULE_PARM_DESC(ring_size, "Set DMA ring size in MiB, power of 2 (default 64)");
+
+static int irq_pages = VBI_IRQ_PAGES_DEF;
+module_param(irq_pages, int, 0);
+MODULE_PARM_DESC(irq_pages, "Set RISC IRQ period in pages, up to half the ring (default 512)");
+
+static char *dma_mode = "coherent";
+module_param(dma_mode, charp, 0444);
+MODULE_PARM_DESC(dma_mode, "Map the DMA ring coherent or streaming (default coherent)");
+
+/*
+ * Card numbers follow the probe order, which is asynchronous, so entries are
+ * best given by PCI address: "0000:03:00.0=2,0000:04:00.0=3". A plain CPU
+ * applies to the card numbered as its position in the list.
+ */
+static char *irq_cpu;
+module_param(irq_cpu, charp, 0);
+MODULE_PARM_DESC(irq_cpu, "CPU to hint for the IRQ of each card, by PCI address (addr=cpu,...) or card number (cpu,...), -1 for none");
+
 static LIST_HEAD(cx88sdr_devlist);
 static DEFINE_MUTEX(cx88sdr_devlist_lock);
 
-static int cx88sdr_devcount;
+/* Card numbers, freed numbers are reused by the next card */
+static DEFINE_IDA(cx88sdr_ida);
 
 static void cx88sdr_pci_lat_set(struct cx88sdr_dev *dev)
 {
@@ -52,6 +82,25 @@ static void cx88sdr_pci_lat_set(struct cx88sdr_dev *dev)
 	dev->pci_lat = lat;
 }
 
+static void cx88sdr_dma_size_set(struct cx88sdr_dev *dev)
+{
+	ring_size = rounddown_pow_of_two(clamp(ring_size, 1, VBI_DMA_SIZE_MAX));
+	dev->dma_size = ring_size * SZ_1M;
+	dev->dma_pages = dev->dma_size >> PAGE_SHIFT;
+
+	dev->dma_streaming = sysfs_streq(dma_mode, "streaming");
+	if (!dev->dma_streaming && !sysfs_streq(dma_mode, "coherent"))
+		cx88sdr_pr_err("unknown dma_mode %s, using coherent\n", dma_mode);
+
+	/*
+	 * A longer period could alias whole laps in __cx88sdr_gp_sync, with
+	 * streaming mappings the guard takes another quarter of the ring.
+	 */
+	dev->irq_pages = clamp_t(int, irq_pages, 1, dev->dma_streaming ?
+				 dev->dma_pages / 4 : dev->dma_pages / 2);
+	dev->dma_guard = dev->dma_streaming ? 2 * dev->irq_pages : 0;
+}
+
 static void cx88sdr_shutdown(struct cx88sdr_dev *dev)
 {
 	/* Disable RISC Controller and IRQs */
@@ -63,9 +112,11 @@ static void cx88sdr_shutdown(struct cx88sdr_dev *dev)
 	/* Stop interrupts */
 	mmio_iowrite32(dev, MO_PCI_INTMSK, 0);
 	mmio_iowrite32(dev, MO_VID_INTMSK, 0);
+	dev->vid_intmsk = 0;
 
 	/* Stop capturing */
 	mmio_iowrite32(dev, MO_CAPTURE_CTRL, 0);
+	cx88sdr_shadow_invalidate(dev);
 
 	mmio_iowrite32(dev, MO_VID_INTSTAT, ~0u);
 }
@@ -108,16 +159,412 @@ static void cx88sdr_adc_setup(struct cx88sdr_dev *dev)
 
 	/* Power down audio and chroma DAC+ADC */
 	mmio_iowrite32(dev, MO_AFECFG_IO, 0x12);
+}
+
+/*
+ * MO_VBI_GPCNT counts the pages written in the current lap of the ring,
+ * accumulate it into a count of all the pages written. Must be called at
+ * least once per half lap, the RISC IRQ period is clamped to that.
+ */
+static void __cx88sdr_gp_sync(struct cx88sdr_dev *dev)
+{
+	uint32_t gp_cnt = mmio_ioread32(dev, MO_VBI_GPCNT);
+
+	dev->gp_total += (gp_cnt + dev->dma_pages - dev->gp_last) %
+			 dev->dma_pages;
+	dev->gp_last = gp_cnt;
+}
+
+/*
+ * Sync the absolute ring pages [from, to) for the CPU or hand them back to
+ * the card, one call per part of a block.
+ */
+static void cx88sdr_dma_sync_range(struct cx88sdr_dev *dev, u64 from, u64 to,
+				   bool for_cpu)
+{
+	struct cx88sdr_dma_chunk *chunk = dev->chunks;
+	unsigned long off, len;
+	uint32_t pnum, n;
+
+	while (from < to) {
+		pnum = from & (dev->dma_pages - 1);
+		while (pnum >= chunk->pnum + (chunk->size >> PAGE_SHIFT))
+			chunk++;
+		while (pnum < chunk->pnum)
+			chunk--;
+		n = min_t(u64, to - from,
+			  chunk->pnum + (chunk->size >> PAGE_SHIFT) - pnum);
+		off = (unsigned long)(pnum - chunk->pnum) << PAGE_SHIFT;
+		len = (unsigned long)n << PAGE_SHIFT;
+		if (for_cpu)
+			dma_sync_single_range_for_cpu(&dev->pdev->dev, chunk->phy,
+						      off, len, DMA_FROM_DEVICE);
+		else
+			dma_sync_single_range_for_device(&dev->pdev->dev,
+							 chunk->phy, off, len,
+							 DMA_FROM_DEVICE);
+		from += n;
+	}
+}
+
+/*
+ * With streaming mappings the pages completed up to gp_total are synced for
+ * the CPU before the caller gets gp_total, every reader and the IRQ thread
+ * come through here, never the hard IRQ. The slots the card writes until
+ * dma_guard pages past gp_total are handed back to it, their old data counts
+ * as overrun for the readers. The IRQ thread runs once per irq_pages, within
+ * the guard of 2 * irq_pages, so the card stays on slots it owns.
+ */
+static void cx88sdr_dma_sync(struct cx88sdr_dev *dev, u64 gp_total)
+{
+	u64 done = gp_total ? (gp_total - 1) : 0;
+	u64 ahead = gp_total + dev->dma_guard;
+
+	spin_lock(&dev->dma_sync_lock);
+	/* Nothing to sync before the first start, the ring may not exist */
+	if (!dev->gp_device)
+		goto unlock;
+	/* Pages more than a lap behind were handed back already */
+	if (done > dev->gp_synced + dev->dma_pages)
+		dev->gp_synced = done - dev->dma_pages;
+	if (done > dev->gp_synced) {
+		cx88sdr_dma_sync_range(dev, dev->gp_synced, done, true);
+		dev->gp_synced = done;
+	}
+	if (ahead > dev->gp_device + dev->dma_pages)
+		dev->gp_device = ahead - dev->dma_pages;
+	if (ahead > dev->gp_device) {
+		cx88sdr_dma_sync_range(dev, dev->gp_device, ahead, false);
+		dev->gp_device = ahead;
+	}
+unlock:
+	spin_unlock(&dev->dma_sync_lock);
+}
+
+u64 cx88sdr_gp_sync(struct cx88sdr_dev *dev)
+{
+	unsigned long flags;
+	u64 gp_total;
+
+	spin_lock_irqsave(&dev->gp_lock, flags);
+	__cx88sdr_gp_sync(dev);
+	gp_total = dev->gp_total;
+	spin_unlock_irqrestore(&dev->gp_lock, flags);
+	if (dev->dma_streaming)
+		cx88sdr_dma_sync(dev, gp_total);
+	return gp_total;
+}
+
+static void __cx88sdr_ts_add(struct cx88sdr_dev *dev, u64 page, u64 ns)
+{
+	struct cx88sdr_ts *ts = &dev->ts[dev->ts_seq++ % CX88SDR_TS_ENTRIES];
+
+	ts->page = page;
+	ts->ns = ns;
+	if (dev->ts_count < CX88SDR_TS_ENTRIES)
+		dev->ts_count++;
+}
+
+/* Record the page count at the time of a RISC IRQ */
+static void cx88sdr_ts_record(struct cx88sdr_dev *dev, u64 ns)
+{
+	unsigned long flags;
 
+	spin_lock_irqsave(&dev->gp_lock, flags);
+	__cx88sdr_gp_sync(dev);
+	__cx88sdr_ts_add(dev, dev->gp_total, ns);
+	spin_unlock_irqrestore(&dev->gp_lock, flags);
+}
+
+/* Copy up to max of the newest timestamps, oldest first */
+u32 cx88sdr_ts_get(struct cx88sdr_dev *dev, struct cx88sdr_ts *ts, u32 max)
+{
+	unsigned long flags;
+	u32 i, n;
+
+	spin_lock_irqsave(&dev->gp_lock, flags);
+	n = min(dev->ts_count, max);
+	for (i = 0; i < n; i++)
+		ts[i] = dev->ts[(dev->ts_seq - n + i) % CX88SDR_TS_ENTRIES];
+	spin_unlock_irqrestore(&dev->gp_lock, flags);
+	return n;
+}
+
+/* Record the current settings as a change at the next safe page */
+void cx88sdr_mark(struct cx88sdr_dev *dev)
+{
+	struct cx88sdr_mark *mark;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->gp_lock, flags);
+	__cx88sdr_gp_sync(dev);
+	mark = &dev->marks[dev->mark_seq % CX88SDR_MARK_ENTRIES];
+	mark->page = dev->gp_total + CX88SDR_MARK_GUARD_PAGES;
+	mark->seq = ++dev->mark_seq;
+	mark->rate = dev->rate;
+	mark->input = dev->input;
+	mark->gain = dev->gain;
+	spin_unlock_irqrestore(&dev->gp_lock, flags);
+}
+
+/* Copy up to max of the newest changes, oldest first */
+u32 cx88sdr_marks_get(struct cx88sdr_dev *dev, struct cx88sdr_mark *marks,
+		      u32 max)
+{
+	unsigned long flags;
+	u32 i, n;
+
+	spin_lock_irqsave(&dev->gp_lock, flags);
+	n = min3(dev->mark_seq, max, (u32)CX88SDR_MARK_ENTRIES);
+	for (i = 0; i < n; i++)
+		marks[i] = dev->marks[(dev->mark_seq - n + i) %
+				      CX88SDR_MARK_ENTRIES];
+	spin_unlock_irqrestore(&dev->gp_lock, flags);
+	return n;
+}
+
+/* Store the level of a measured block, the ring keeps the newest ones */
+void cx88sdr_level_add(struct cx88sdr_dev *dev, struct cx88sdr_level *lvl)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->gp_lock, flags);
+	lvl->seq = ++dev->level_seq;
+	dev->levels[(lvl->seq - 1) % CX88SDR_LEVEL_ENTRIES] = *lvl;
+	spin_unlock_irqrestore(&dev->gp_lock, flags);
+}
+
+/* Copy up to max of the newest levels, oldest first */
+u32 cx88sdr_levels_get(struct cx88sdr_dev *dev, struct cx88sdr_level *levels,
+		       u32 max)
+{
+	unsigned long flags;
+	u32 i, n;
+
+	spin_lock_irqsave(&dev->gp_lock, flags);
+	n = min3(dev->level_seq, max, (u32)CX88SDR_LEVEL_ENTRIES);
+	for (i = 0; i < n; i++)
+		levels[i] = dev->levels[(dev->level_seq - n + i) %
+					CX88SDR_LEVEL_ENTRIES];
+	spin_unlock_irqrestore(&dev->gp_lock, flags);
+	return n;
+}
+
+/*
+ * Estimate the time at which the page count reached page, interpolated
+ * between the two closest RISC IRQs or extrapolated from the newest ones.
+ */
+u64 cx88sdr_ts_lookup(struct cx88sdr_dev *dev, u64 page)
+{
+	struct cx88sdr_ts a, b;
+	unsigned long flags;
+	u64 j, oldest;
+
+	spin_lock_irqsave(&dev->gp_lock, flags);
+	if (dev->ts_count < 2) {
+		spin_unlock_irqrestore(&dev->gp_lock, flags);
+		return ktime_get_ns();
+	}
+	oldest = dev->ts_seq - dev->ts_count;
+	for (j = dev->ts_seq - 1; j > oldest + 1; j--) {
+		if (dev->ts[(j - 1) % CX88SDR_TS_ENTRIES].page <= page)
+			break;
+	}
+	a = dev->ts[(j - 1) % CX88SDR_TS_ENTRIES];
+	b = dev->ts[j % CX88SDR_TS_ENTRIES];
+	spin_unlock_irqrestore(&dev->gp_lock, flags);
+
+	if (b.page == a.page)
+		return b.ns;
+	return a.ns + div64_s64((s64)(page - a.page) * (s64)(b.ns - a.ns),
+				(s64)(b.page - a.page));
+}
+
+/* Prepare the RISC program to run from the first page */
+static void cx88sdr_dma_arm(struct cx88sdr_dev *dev)
+{
+	unsigned long flags;
+	u64 gp_base;
+
+	/* Restart the RISC program from the first page */
+	cx88sdr_sram_setup(dev, CLUSTER_BUF_NUM, CLUSTER_BUF_SIZE,
+			   CLUSTER_BUFFER_BASE, CDT_BASE);
+
+	spin_lock_irqsave(&dev->gp_lock, flags);
+	mmio_iowrite32(dev, MO_VBI_GPCNTRL, GP_COUNT_CONTROL_RESET);
+	dev->gp_total = round_up(dev->gp_total, (u64)dev->dma_pages);
+	dev->gp_last = 0;
+	/* The page count jumps, older timestamps no longer apply */
+	dev->ts_count = 0;
+	/* Pages before are from the previous run */
+	dev->gp_base = dev->gp_total;
+	gp_base = dev->gp_base;
+	spin_unlock_irqrestore(&dev->gp_lock, flags);
+
+	/*
+	 * The card owns the whole ring again, the old data is from before.
+	 * Not under gp_lock, the hard IRQ takes it while a reader may hold
+	 * dma_sync_lock. The card isn't started yet, so readers syncing in
+	 * between only touch pages of the previous run.
+	 */
+	if (dev->dma_streaming) {
+		spin_lock(&dev->dma_sync_lock);
+		cx88sdr_dma_sync_range(dev, 0, dev->dma_pages, false);
+		dev->gp_synced = gp_base;
+		dev->gp_device = gp_base + dev->dma_pages;
+		spin_unlock(&dev->dma_sync_lock);
+	}
+}
+
+static void cx88sdr_dma_go(struct cx88sdr_dev *dev)
+{
 	/* Start DMA */
 	mmio_iowrite32(dev, MO_DEV_CNTRL2, (1 << 5));
 	mmio_iowrite32(dev, MO_VID_DMACNTRL, (1 << 7) | (1 << 3));
 }
 
+static void cx88sdr_dma_start(struct cx88sdr_dev *dev)
+{
+	cx88sdr_dma_arm(dev);
+	cx88sdr_dma_go(dev);
+}
+
+static void cx88sdr_dma_stop(struct cx88sdr_dev *dev)
+{
+	/* Disable RISC Controller and stop DMA transfers */
+	mmio_iowrite32(dev, MO_DEV_CNTRL2, 0);
+	mmio_iowrite32(dev, MO_VID_DMACNTRL, 0);
+}
+
+/* First page of the current run, readers behind it must resync */
+u64 cx88sdr_gp_base(struct cx88sdr_dev *dev)
+{
+	unsigned long flags;
+	u64 gp_base;
+
+	spin_lock_irqsave(&dev->gp_lock, flags);
+	gp_base = dev->gp_base;
+	spin_unlock_irqrestore(&dev->gp_lock, flags);
+	return gp_base;
+}
+
+static struct cx88sdr_dev *cx88sdr_dev_find(int nr)
+{
+	struct cx88sdr_dev *dev;
+
+	list_for_each_entry(dev, &cx88sdr_devlist, devlist) {
+		if (dev->nr == nr)
+			return dev;
+	}
+	return NULL;
+}
+
+/*
+ * Restart the running DMA engines of several cards together. The engines are
+ * stopped and their RISC programs rewound first, then released back to back
+ * with interrupts off. The last register read of each card flushes the posted
+ * writes, its time is the reported start of that card.
+ */
+int cx88sdr_sync_start(struct cx88sdr_sync_start *sync)
+{
+	struct cx88sdr_dev *devs[CX88SDR_SYNC_MAX];
+	u64 start[CX88SDR_SYNC_MAX];
+	unsigned long flags;
+	u32 i, j, n = sync->count;
+	int ret = 0;
+
+	if (!n || n > CX88SDR_SYNC_MAX)
+		return -EINVAL;
+
+	mutex_lock(&cx88sdr_devlist_lock);
+	for (i = 0; i < n; i++) {
+		devs[i] = cx88sdr_dev_find(sync->cards[i]);
+		if (!devs[i]) {
+			ret = -ENODEV;
+			goto unlock_list;
+		}
+		for (j = 0; j < i; j++) {
+			if (devs[j] == devs[i]) {
+				ret = -EINVAL;
+				goto unlock_list;
+			}
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		mutex_lock_nest_lock(&devs[i]->dma_mlock, &cx88sdr_devlist_lock);
+		/* Removed but still listed, the hardware is no longer ours */
+		if (devs[i]->gone || !devs[i]->dma_users) {
+			ret = devs[i]->gone ? -ENODEV : -EIO;
+			mutex_unlock(&devs[i]->dma_mlock);
+			goto unlock_devs;
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		cx88sdr_dma_stop(devs[i]);
+	for (i = 0; i < n; i++)
+		cx88sdr_dma_arm(devs[i]);
+
+	local_irq_save(flags);
+	for (i = 0; i < n; i++) {
+		cx88sdr_dma_go(devs[i]);
+		mmio_ioread32(devs[i], MO_VID_DMACNTRL);
+		start[i] = ktime_get_ns();
+	}
+	local_irq_restore(flags);
+
+	for (i = 0; i < n; i++) {
+		spin_lock_irqsave(&devs[i]->gp_lock, flags);
+		__cx88sdr_ts_add(devs[i], devs[i]->gp_base, start[i]);
+		sync->start_page[i] = devs[i]->gp_base;
+		spin_unlock_irqrestore(&devs[i]->gp_lock, flags);
+		sync->start_ns[i] = start[i];
+		sync->offset_ns[i] = start[i] - start[0];
+		wake_up_interruptible(&devs[i]->wq);
+	}
+
+unlock_devs:
+	while (i--)
+		mutex_unlock(&devs[i]->dma_mlock);
+unlock_list:
+	mutex_unlock(&cx88sdr_devlist_lock);
+	return ret;
+}
+
+/* PCI interrupts stay enabled while any reader or stream needs them */
+void cx88sdr_intr_get(struct cx88sdr_dev *dev)
+{
+	mutex_lock(&dev->dma_mlock);
+	if (!dev->intr_users++ && !dev->gone)
+		mmio_iowrite32(dev, MO_PCI_INTMSK, 1);
+	mutex_unlock(&dev->dma_mlock);
+}
+
+void cx88sdr_intr_put(struct cx88sdr_dev *dev)
+{
+	mutex_lock(&dev->dma_mlock);
+	if (!--dev->intr_users && !dev->gone)
+		mmio_iowrite32(dev, MO_PCI_INTMSK, 0);
+	mutex_unlock(&dev->dma_mlock);
+}
+
+/*
+ * Every VBI packet is a line for the RISC controller and needs its own WRITE
+ * with SOL/EOL set: FRM_SIZE in MO_VBI_PACKET is limited to 4088 bytes and
+ * WRITEC can't start a line, so one WRITE per CLUSTER_BUF_SIZE packet is the
+ * densest program the hardware accepts, even on contiguous blocks.
+ */
+static uint32_t cx88sdr_risc_inst_size(struct cx88sdr_dev *dev)
+{
+	/* SYNC, 2 dwords per WRITE and the closing JUMP */
+	return (1 + dev->dma_pages * RISC_PACKETS_PER_PAGE * 2 + 2) *
+	       sizeof(uint32_t);
+}
+
 static int cx88sdr_alloc_risc_inst_buffer(struct cx88sdr_dev *dev)
 {
-	/* Add 1 page for sync instructions and jump */
-	dev->risc_inst_buff_size = VBI_DMA_BUF_NUM * CLUSTER_BUF_NUM + PAGE_SIZE;
+	dev->risc_inst_buff_size = PAGE_ALIGN(cx88sdr_risc_inst_size(dev));
 	dev->risc_inst_virt = dma_alloc_coherent(&dev->pdev->dev,
 						 dev->risc_inst_buff_size,
 						 &dev->risc_inst_phy, GFP_KERNEL);
@@ -136,64 +583,155 @@ static void cx88sdr_free_risc_inst_buffer(struct cx88sdr_dev *dev)
 	if (dev->risc_inst_virt)
 		dma_free_coherent(&dev->pdev->dev, dev->risc_inst_buff_size,
 				  dev->risc_inst_virt, dev->risc_inst_phy);
+	dev->risc_inst_virt = NULL;
 }
 
-static int cx88sdr_alloc_dma_buffer(struct cx88sdr_dev *dev)
+/*
+ * A streaming block is a run of ordinary cacheable pages mapped for the card,
+ * taken from the card node. Pages the 32-bit DMA mask can't reach directly
+ * would need a bounce buffer, those are replaced from ZONE_DMA32, which may
+ * be on another node. Behind an IOMMU this happens without need.
+ */
+static void *cx88sdr_alloc_dma_chunk(struct cx88sdr_dev *dev,
+				     struct cx88sdr_dma_chunk *chunk,
+				     uint32_t size)
 {
-	int i;
-	u32 dma_size = 0;
-
-	for (i = 0; i < (VBI_DMA_PAGES + 1); i++) {
-		dev->pgvec_virt[i] = NULL;
-		dev->pgvec_phy[i] = 0;
+	gfp_t gfp = GFP_KERNEL | ((size > PAGE_SIZE) ? __GFP_NOWARN : 0);
+	struct page *page;
+
+	if (!dev->dma_streaming)
+		return dma_alloc_coherent(&dev->pdev->dev, size, &chunk->phy,
+					  gfp);
+
+	page = alloc_pages_node(dev->node, gfp, get_order(size));
+	if (page && (page_to_phys(page) + size - 1 >
+		     dma_get_mask(&dev->pdev->dev))) {
+		__free_pages(page, get_order(size));
+		page = alloc_pages_node(dev->node, gfp | GFP_DMA32,
+					get_order(size));
 	}
-
-	for (i = 0; i < VBI_DMA_PAGES; i++) {
-		dma_addr_t dma_handle;
-
-		dev->pgvec_virt[i] = dma_alloc_coherent(&dev->pdev->dev,
-							PAGE_SIZE, &dma_handle,
-							GFP_KERNEL);
-		if (!dev->pgvec_virt[i])
-			return -ENOMEM;
-		dev->pgvec_phy[i] = dma_handle;
-		dma_size += PAGE_SIZE;
+	if (!page)
+		return NULL;
+	if ((dev->node != NUMA_NO_NODE) && (page_to_nid(page) != dev->node))
+		dev->dma_remote_pages += size >> PAGE_SHIFT;
+	chunk->phy = dma_map_page(&dev->pdev->dev, page, 0, size,
+				  DMA_FROM_DEVICE);
+	if (dma_mapping_error(&dev->pdev->dev, chunk->phy)) {
+		__free_pages(page, get_order(size));
+		return NULL;
 	}
+	return page_address(page);
+}
 
-	cx88sdr_pr_info("DMA size %uMiB\n", dma_size / 1024 / 1024);
-	return 0;
+static void cx88sdr_free_dma_chunk(struct cx88sdr_dev *dev,
+				   struct cx88sdr_dma_chunk *chunk)
+{
+	if (!dev->dma_streaming) {
+		dma_free_coherent(&dev->pdev->dev, chunk->size, chunk->virt,
+				  chunk->phy);
+		return;
+	}
+	dma_unmap_page(&dev->pdev->dev, chunk->phy, chunk->size,
+		       DMA_FROM_DEVICE);
+	free_pages((unsigned long)chunk->virt, get_order(chunk->size));
 }
 
 static void cx88sdr_free_dma_buffer(struct cx88sdr_dev *dev)
 {
 	int i;
 
-	for (i = 0; i < VBI_DMA_PAGES; i++) {
-		if (dev->pgvec_virt[i])
-			dma_free_coherent(&dev->pdev->dev, PAGE_SIZE,
-					  dev->pgvec_virt[i], dev->pgvec_phy[i]);
+	for (i = 0; i < dev->nr_chunks; i++)
+		cx88sdr_free_dma_chunk(dev, &dev->chunks[i]);
+	kfree(dev->chunks);
+	dev->chunks = NULL;
+	dev->nr_chunks = 0;
+	dev->dma_remote_pages = 0;
+	kvfree(dev->pgvec_virt);
+	kvfree(dev->pgvec_phy);
+	dev->pgvec_virt = NULL;
+	dev->pgvec_phy = NULL;
+}
+
+/*
+ * Allocate the ring from the largest blocks available, halving the block size
+ * when an allocation fails. The ring size is a power of 2 so the remaining
+ * size is always a multiple of the block size. The blocks come from the NUMA
+ * node of the card, the page tables are put there too.
+ */
+static int cx88sdr_alloc_dma_buffer(struct cx88sdr_dev *dev)
+{
+	uint32_t i, pnum = 0, nr_alloc = 0;
+	uint32_t size = min_t(uint32_t, CX88SDR_DMA_CHUNK_MAX, dev->dma_size);
+
+	dev->pgvec_virt = kvzalloc_node(dev->dma_pages * sizeof(*dev->pgvec_virt),
+					GFP_KERNEL, dev->node);
+	dev->pgvec_phy = kvzalloc_node(dev->dma_pages * sizeof(*dev->pgvec_phy),
+				       GFP_KERNEL, dev->node);
+	if (!dev->pgvec_virt || !dev->pgvec_phy)
+		goto free_dma_buffer;
+
+	while (pnum < dev->dma_pages) {
+		struct cx88sdr_dma_chunk *chunk;
+
+		if (dev->nr_chunks == nr_alloc) {
+			nr_alloc = nr_alloc ? (nr_alloc * 2) : 16;
+			chunk = krealloc(dev->chunks, nr_alloc * sizeof(*chunk),
+					 GFP_KERNEL);
+			if (!chunk)
+				goto free_dma_buffer;
+			dev->chunks = chunk;
+		}
+
+		chunk = &dev->chunks[dev->nr_chunks];
+		chunk->virt = cx88sdr_alloc_dma_chunk(dev, chunk, size);
+		if (!chunk->virt) {
+			if (size == PAGE_SIZE)
+				goto free_dma_buffer;
+			size >>= 1;
+			continue;
+		}
+		chunk->size = size;
+		chunk->pnum = pnum;
+		dev->nr_chunks++;
+
+		for (i = 0; i < (size >> PAGE_SHIFT); i++, pnum++) {
+			dev->pgvec_virt[pnum] = chunk->virt + (i << PAGE_SHIFT);
+			dev->pgvec_phy[pnum] = chunk->phy + (i << PAGE_SHIFT);
+		}
 	}
+
+	cx88sdr_pr_info("DMA size %uMiB in %u %s blocks\n",
+			dev->dma_size / 1024 / 1024, dev->nr_chunks,
+			dev->dma_streaming ? "streaming" : "coherent");
+	return 0;
+
+free_dma_buffer:
+	cx88sdr_free_dma_buffer(dev);
+	return -ENOMEM;
 }
 
 static void cx88sdr_make_risc_instructions(struct cx88sdr_dev *dev)
 {
-	int i, irqt = 0;
-	uint32_t dma_addr, loop_addr;
+	int i, j, irqt = 0;
+	uint32_t cmd, loop_addr;
 	uint32_t *pp = dev->risc_inst_virt;
 
 	loop_addr = dev->risc_inst_phy + 4;
 	*pp++ = RISC_SYNC | (3 << 16);
 
-	for (i = 0; i < VBI_DMA_PAGES; i++) {
+	for (i = 0; i < dev->dma_pages; i++) {
 		irqt++;
-		irqt &= 0x1ff;
-		*pp++ = RISC_WRITE | CLUSTER_BUF_SIZE | (3 << 26);
-		dma_addr = dev->pgvec_phy[i];
-		*pp++ = dma_addr;
-		*pp++ = RISC_WRITE | CLUSTER_BUF_SIZE | (3 << 26) |
-		       (((irqt == 0) ? 1 : 0) << 24) |
-		       (((i < VBI_DMA_PAGES - 1) ? 1 : 3) << 16);
-		*pp++ = dma_addr + CLUSTER_BUF_SIZE;
+		if (irqt == dev->irq_pages)
+			irqt = 0;
+		for (j = 0; j < RISC_PACKETS_PER_PAGE; j++) {
+			cmd = RISC_WRITE | CLUSTER_BUF_SIZE | (3 << 26);
+			/* Count the page and raise the IRQ on its last packet */
+			if (j == RISC_PACKETS_PER_PAGE - 1)
+				cmd |= (((irqt == 0) ? 1 : 0) << 24) |
+				       (((i < dev->dma_pages - 1) ? 1 : 3) << 16);
+			*pp++ = cmd;
+			*pp++ = dev->pgvec_phy[i] + j * CLUSTER_BUF_SIZE;
+		}
 	}
 	*pp++ = RISC_JUMP;
 	*pp++ = loop_addr;
@@ -202,23 +740,218 @@ static void cx88sdr_make_risc_instructions(struct cx88sdr_dev *dev)
 		       (uint32_t)(((void *)pp - (void *)dev->risc_inst_virt) / 1024));
 }
 
+/*
+ * The ring and its RISC program are allocated when the card is first used,
+ * not at probe, and are kept until the card is removed.
+ */
+static int cx88sdr_ring_alloc(struct cx88sdr_dev *dev)
+{
+	int ret;
+
+	if (dev->nr_chunks)
+		return 0;
+
+	ret = cx88sdr_alloc_risc_inst_buffer(dev);
+	if (ret) {
+		cx88sdr_pr_err("can't alloc risc buffers\n");
+		return ret;
+	}
+
+	ret = cx88sdr_alloc_dma_buffer(dev);
+	if (ret) {
+		cx88sdr_pr_err("can't alloc DMA buffers\n");
+		cx88sdr_free_risc_inst_buffer(dev);
+		return ret;
+	}
+
+	cx88sdr_make_risc_instructions(dev);
+	return 0;
+}
+
+/*
+ * The RISC/DMA engine runs as long as it has at least one user, the card is
+ * powered as long as the engine runs. The runtime PM calls are made without
+ * dma_mlock, the PM callbacks take it.
+ */
+int cx88sdr_dma_get(struct cx88sdr_dev *dev)
+{
+	int ret;
+
+	ret = pm_runtime_get_sync(&dev->pdev->dev);
+	if (ret < 0)
+		goto put;
+
+	mutex_lock(&dev->dma_mlock);
+	ret = dev->gone ? -ENODEV : 0;
+	if (!ret && !dev->dma_users) {
+		ret = cx88sdr_ring_alloc(dev);
+		if (ret)
+			goto unlock;
+		cx88sdr_dma_start(dev);
+	}
+	dev->dma_users++;
+unlock:
+	mutex_unlock(&dev->dma_mlock);
+	if (!ret)
+		return 0;
+put:
+	pm_runtime_put_autosuspend(&dev->pdev->dev);
+	return ret;
+}
+
+void cx88sdr_dma_put(struct cx88sdr_dev *dev)
+{
+	bool last;
+
+	mutex_lock(&dev->dma_mlock);
+	last = !--dev->dma_users;
+	if (last && !dev->gone)
+		cx88sdr_dma_stop(dev);
+	mutex_unlock(&dev->dma_mlock);
+
+	/* Outside dma_mlock, the sweep takes the control lock */
+	if (last)
+		cx88sdr_sweep_clear(dev);
+
+	pm_runtime_mark_last_busy(&dev->pdev->dev);
+	pm_runtime_put_autosuspend(&dev->pdev->dev);
+}
+
+/*
+ * Hard IRQ, acknowledge the card and record the page count with the time of
+ * the interrupt. Everything else is left to the IRQ thread.
+ */
 static irqreturn_t cx88sdr_irq(int irq, void *dev_id)
 {
 	struct cx88sdr_dev *dev = dev_id;
-	int i, handled = 0;
-	uint32_t mask, status;
-
-	for (i = 0; i < 10; i++) {
-		status = mmio_ioread32(dev, MO_VID_INTSTAT);
-		mask = mmio_ioread32(dev, MO_VID_INTMSK);
-		if ((status & mask) == 0)
-			goto out;
-		mmio_iowrite32(dev, MO_VID_INTSTAT, status);
-		handled = 1;
+	uint32_t status;
+
+	status = mmio_ioread32(dev, MO_VID_INTSTAT) & READ_ONCE(dev->vid_intmsk);
+	if (!status)
+		return IRQ_NONE;
+	mmio_iowrite32(dev, MO_VID_INTSTAT, status);
+	dev->stats.irqs++;
+
+	if (status & VID_INT_VBI_RISCI1)
+		cx88sdr_ts_record(dev, ktime_get_ns());
+	atomic_or(status, &dev->irq_status);
+	return IRQ_WAKE_THREAD;
+}
+
+static irqreturn_t cx88sdr_irq_thread(int irq, void *dev_id)
+{
+	struct cx88sdr_dev *dev = dev_id;
+	uint32_t status = atomic_xchg(&dev->irq_status, 0);
+
+	/* Wake up readers waiting for new pages */
+	if (status & VID_INT_VBI_RISCI1) {
+		/* Keeps the streaming handoff ahead of the card without readers */
+		if (dev->dma_streaming)
+			cx88sdr_gp_sync(dev);
+		wake_up_interruptible(&dev->wq);
+		if (dev->vb_streaming)
+			cx88sdr_vb_fill(dev);
+		cx88sdr_levels_update(dev);
+		cx88sdr_sweep_step(dev);
+	}
+	return IRQ_HANDLED;
+}
+
+/* The irq_cpu entry of the card, its PCI address wins over its number */
+static int cx88sdr_irq_cpu(struct cx88sdr_dev *dev)
+{
+	char *buf, *s, *tok, *eq;
+	int i, val, cpu = -1;
+
+	if (!irq_cpu)
+		return -1;
+	buf = kstrdup(irq_cpu, GFP_KERNEL);
+	if (!buf)
+		return -1;
+
+	for (s = buf, i = 0; (tok = strsep(&s, ",")); i++) {
+		eq = strchr(tok, '=');
+		if (eq) {
+			*eq = '\0';
+			if (!strcmp(strim(tok), pci_name(dev->pdev)) &&
+			    !kstrtoint(strim(eq + 1), 0, &val)) {
+				cpu = val;
+				break;
+			}
+		} else if ((i == dev->nr) && !kstrtoint(strim(tok), 0, &val)) {
+			cpu = val;
+		}
+	}
+	kfree(buf);
+	return cpu;
+}
+
+/* MSI if the platform provides it, the interrupt line otherwise */
+static int cx88sdr_irq_setup(struct cx88sdr_dev *dev)
+{
+	struct pci_dev *pdev = dev->pdev;
+	int ret, cpu;
+
+	ret = pci_alloc_irq_vectors(pdev, 1, 1, PCI_IRQ_MSI | PCI_IRQ_LEGACY);
+	if (ret < 0)
+		return ret;
+	dev->irq = pci_irq_vector(pdev, 0);
+
+	snprintf(dev->irq_name, sizeof(dev->irq_name), KBUILD_MODNAME "[%d]",
+		 dev->nr);
+	ret = request_threaded_irq(dev->irq, cx88sdr_irq, cx88sdr_irq_thread,
+				   pdev->msi_enabled ? 0 : IRQF_SHARED,
+				   dev->irq_name, dev);
+	if (ret) {
+		pci_free_irq_vectors(pdev);
+		return ret;
 	}
 
-out:
-	return IRQ_RETVAL(handled);
+	/*
+	 * The IRQ thread follows the affinity of the interrupt, by default it
+	 * runs on the node of the card, next to the ring.
+	 */
+	cpu = cx88sdr_irq_cpu(dev);
+	if ((cpu >= 0) && cpu_online(cpu))
+		irq_set_affinity_hint(dev->irq, cpumask_of(cpu));
+	else if (dev->node != NUMA_NO_NODE)
+		irq_set_affinity_hint(dev->irq, cpumask_of_node(dev->node));
+	return 0;
+}
+
+static void cx88sdr_irq_free(struct cx88sdr_dev *dev)
+{
+	irq_set_affinity_hint(dev->irq, NULL);
+	free_irq(dev->irq, dev);
+	pci_free_irq_vectors(dev->pdev);
+}
+
+/* Register state lost when the card is powered down, the ring is kept */
+static void cx88sdr_hw_setup(struct cx88sdr_dev *dev)
+{
+	cx88sdr_adc_setup(dev);
+	cx88sdr_rate_set(dev);
+	cx88sdr_agc_setup(dev);
+	cx88sdr_input_set(dev);
+}
+
+/*
+ * Open files and user mappings of the ring can outlive the card, the ring,
+ * the MMIO mapping and dev are kept until the last of them is gone.
+ */
+static void cx88sdr_release_dev(struct v4l2_device *v4l2_dev)
+{
+	struct cx88sdr_dev *dev = container_of(v4l2_dev, struct cx88sdr_dev, v4l2_dev);
+	struct pci_dev *pdev = dev->pdev;
+
+	v4l2_ctrl_handler_free(&dev->ctrl_handler);
+	cx88sdr_free_dma_buffer(dev);
+	cx88sdr_free_risc_inst_buffer(dev);
+	iounmap(dev->mmio);
+	pci_release_regions(pdev);
+	ida_free(&cx88sdr_ida, dev->nr);
+	kfree(dev);
+	pci_dev_put(pdev);
 }
 
 static int cx88sdr_probe(struct pci_dev *pdev, const struct pci_device_id *pci_id)
@@ -226,11 +959,9 @@ static int cx88sdr_probe(struct pci_dev *pdev, const struct pci_device_id *pci_i
 	struct cx88sdr_dev *dev;
 	struct v4l2_device *v4l2_dev;
 	struct v4l2_ctrl_handler *hdl;
+	struct vb2_queue *q;
 	int ret;
 
-	if (cx88sdr_devcount == CX88SDR_MAX_CARDS)
-		return -ENODEV;
-
 	ret = pci_enable_device(pdev);
 	if (ret)
 		return ret;
@@ -243,76 +974,65 @@ static int cx88sdr_probe(struct pci_dev *pdev, const struct pci_device_id *pci_i
 		goto disable_device;
 	}
 
-	dev = devm_kzalloc(&pdev->dev, sizeof(*dev), GFP_KERNEL);
+	/* The ring position and IRQ state are hot, keep them on the card node */
+	dev = kzalloc_node(sizeof(*dev), GFP_KERNEL, dev_to_node(&pdev->dev));
 	if (!dev) {
 		ret = -ENOMEM;
 		dev_err(&pdev->dev, "can't allocate memory\n");
 		goto disable_device;
 	}
 
-	dev->nr = cx88sdr_devcount;
+	ret = ida_alloc(&cx88sdr_ida, GFP_KERNEL);
+	if (ret < 0)
+		goto free_dev;
+	dev->nr = ret;
 	dev->pdev = pdev;
+	dev->node = dev_to_node(&pdev->dev);
 
 	cx88sdr_pci_lat_set(dev);
+	cx88sdr_dma_size_set(dev);
 
 	ret = pci_request_regions(pdev, KBUILD_MODNAME);
 	if (ret) {
 		cx88sdr_pr_err("can't request memory regions\n");
-		goto disable_device;
-	}
-
-	ret = cx88sdr_alloc_risc_inst_buffer(dev);
-	if (ret) {
-		cx88sdr_pr_err("can't alloc risc buffers\n");
-		goto free_pci_regions;
-	}
-
-	ret = cx88sdr_alloc_dma_buffer(dev);
-	if (ret) {
-		cx88sdr_pr_err("can't alloc DMA buffers\n");
-		goto cx88sdr_free_risc_inst_buffer;
+		goto free_nr;
 	}
 
-	cx88sdr_make_risc_instructions(dev);
-
 	dev->mmio = pci_ioremap_bar(pdev, 0);
 	if (dev->mmio == NULL) {
 		ret = -ENODEV;
 		cx88sdr_pr_err("can't ioremap BAR 0\n");
-		goto cx88sdr_free_dma_buffer;
+		goto free_pci_regions;
 	}
 
 	cx88sdr_shutdown(dev);
 	wmb(); /* Ensure card reset */
 
-	cx88sdr_sram_setup(dev, CLUSTER_BUF_NUM, CLUSTER_BUF_SIZE,
-			   CLUSTER_BUFFER_BASE, CDT_BASE);
+	init_waitqueue_head(&dev->wq);
+	mutex_init(&dev->dma_mlock);
+	mutex_init(&dev->sweep_mlock);
+	spin_lock_init(&dev->gp_lock);
+	spin_lock_init(&dev->dma_sync_lock);
+	INIT_LIST_HEAD(&dev->vb_queued);
+	spin_lock_init(&dev->vb_lock);
 
-	ret = request_irq(pdev->irq, cx88sdr_irq, IRQF_SHARED, KBUILD_MODNAME, dev);
+	ret = cx88sdr_irq_setup(dev);
 	if (ret) {
 		cx88sdr_pr_err("failed to request IRQ\n");
 		goto free_mmio;
 	}
-
-	dev->irq = pdev->irq;
 	synchronize_irq(dev->irq);
 
 	/* Set initial values */
 	dev->gain = 0;
 	dev->input = VMUX_01;
 	dev->rate = RATE_8FSC_8BIT;
-	dev->pixelformat = V4L2_SDR_FMT_CU8; /* Fictitious */
-	dev->buffersize = 1; /* Fictitious */
+	dev->pixelformat = 0; /* Native samples, see cx88sdr_pixelformat() */
+	dev->buffersize = CX88SDR_VB_BUF_SIZE;
 	snprintf(dev->name, sizeof(dev->name), CX88SDR_DRV_NAME " [%d]", dev->nr);
 
-	cx88sdr_adc_setup(dev);
-	cx88sdr_rate_set(dev);
-	cx88sdr_agc_setup(dev);
-	cx88sdr_input_set(dev);
-
-	mutex_lock(&cx88sdr_devlist_lock);
-	list_add_tail(&dev->devlist, &cx88sdr_devlist);
-	mutex_unlock(&cx88sdr_devlist_lock);
+	cx88sdr_hw_setup(dev);
+	dev->hw_ready = true;
 
 	mutex_init(&dev->vdev_mlock);
 	v4l2_dev = &dev->v4l2_dev;
@@ -323,10 +1043,14 @@ static int cx88sdr_probe(struct pci_dev *pdev, const struct pci_device_id *pci_i
 	}
 
 	hdl = &dev->ctrl_handler;
-	v4l2_ctrl_handler_init(hdl, 3);
-	v4l2_ctrl_new_std(hdl, &cx88sdr_ctrl_ops, V4L2_CID_GAIN, 0, 31, 1, dev->gain);
-	v4l2_ctrl_new_custom(hdl, &cx88sdr_ctrl_input, NULL);
+	v4l2_ctrl_handler_init(hdl, 6);
+	dev->ctrl_gain = v4l2_ctrl_new_std(hdl, &cx88sdr_ctrl_ops, V4L2_CID_GAIN,
+					   0, 31, 1, dev->gain);
+	dev->ctrl_input = v4l2_ctrl_new_custom(hdl, &cx88sdr_ctrl_input, NULL);
 	v4l2_ctrl_new_custom(hdl, &cx88sdr_ctrl_rate, NULL);
+	v4l2_ctrl_new_custom(hdl, &cx88sdr_ctrl_decimation, NULL);
+	v4l2_ctrl_new_custom(hdl, &cx88sdr_ctrl_levels, NULL);
+	v4l2_ctrl_new_std(hdl, &cx88sdr_ctrl_ops, V4L2_CID_AUTOGAIN, 0, 1, 1, 0);
 	v4l2_dev->ctrl_handler = hdl;
 	if (hdl->error) {
 		ret = hdl->error;
@@ -334,11 +1058,28 @@ static int cx88sdr_probe(struct pci_dev *pdev, const struct pci_device_id *pci_i
 		goto free_v4l2;
 	}
 
+	/* Initialize the videobuf2 queue */
+	q = &dev->vb_queue;
+	q->type = V4L2_BUF_TYPE_SDR_CAPTURE;
+	q->io_modes = VB2_MMAP | VB2_USERPTR | VB2_DMABUF;
+	q->drv_priv = dev;
+	q->buf_struct_size = sizeof(struct cx88sdr_buf);
+	q->ops = &cx88sdr_vb2_ops;
+	q->mem_ops = &vb2_vmalloc_memops;
+	q->timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+	q->lock = &dev->vdev_mlock;
+	ret = vb2_queue_init(q);
+	if (ret) {
+		v4l2_err(v4l2_dev, "can't init vb2 queue\n");
+		goto free_v4l2;
+	}
+
 	/* Initialize the video_device structure */
 	strscpy(v4l2_dev->name, dev->name, sizeof(v4l2_dev->name));
 	dev->vdev = cx88sdr_template;
 	dev->vdev.ctrl_handler = &dev->ctrl_handler;
 	dev->vdev.lock = &dev->vdev_mlock;
+	dev->vdev.queue = &dev->vb_queue;
 	dev->vdev.v4l2_dev = v4l2_dev;
 	video_set_drvdata(&dev->vdev, dev);
 
@@ -346,28 +1087,46 @@ static int cx88sdr_probe(struct pci_dev *pdev, const struct pci_device_id *pci_i
 	if (ret)
 		goto free_v4l2;
 
-	cx88sdr_pr_info("irq: %d, MMIO: 0x%p, PCI latency: %d\n",
-			dev->pdev->irq, dev->mmio, dev->pci_lat);
+	cx88sdr_pr_info("irq: %d%s, MMIO: 0x%p, PCI latency: %d, NUMA node: %d\n",
+			dev->irq, pdev->msi_enabled ? " (MSI)" : "", dev->mmio,
+			dev->pci_lat, dev->node);
 	cx88sdr_pr_info("registered as %s\n",
 			video_device_node_name(&dev->vdev));
 
+	dev->vid_intmsk = INTERRUPT_MASK;
 	mmio_iowrite32(dev, MO_VID_INTMSK, INTERRUPT_MASK);
-	cx88sdr_devcount++;
+
+	/* Only complete devices are visible to a synchronized start */
+	mutex_lock(&cx88sdr_devlist_lock);
+	list_add_tail(&dev->devlist, &cx88sdr_devlist);
+	mutex_unlock(&cx88sdr_devlist_lock);
+	cx88sdr_debugfs_add(dev);
+
+	/* Freed by cx88sdr_release_dev() once the last user is gone */
+	dev->pdev = pci_dev_get(pdev);
+	v4l2_dev->release = cx88sdr_release_dev;
+
+	/* Power down once idle, the PCI core holds a reference during probe */
+	pm_runtime_set_autosuspend_delay(&pdev->dev, CX88SDR_AUTOSUSPEND_MS);
+	pm_runtime_use_autosuspend(&pdev->dev);
+	pm_runtime_allow(&pdev->dev);
+	pm_runtime_put_autosuspend(&pdev->dev);
 	return 0;
 
 free_v4l2:
 	v4l2_ctrl_handler_free(hdl);
 	v4l2_device_unregister(v4l2_dev);
 free_irq:
-	free_irq(dev->irq, dev);
+	cx88sdr_shutdown(dev);
+	cx88sdr_irq_free(dev);
 free_mmio:
 	iounmap(dev->mmio);
-cx88sdr_free_dma_buffer:
-	cx88sdr_free_dma_buffer(dev);
-cx88sdr_free_risc_inst_buffer:
-	cx88sdr_free_risc_inst_buffer(dev);
 free_pci_regions:
 	pci_release_regions(pdev);
+free_nr:
+	ida_free(&cx88sdr_ida, dev->nr);
+free_dev:
+	kfree(dev);
 disable_device:
 	pci_disable_device(pdev);
 	return ret;
@@ -378,29 +1137,95 @@ static void cx88sdr_remove(struct pci_dev *pdev)
 	struct v4l2_device *v4l2_dev = pci_get_drvdata(pdev);
 	struct cx88sdr_dev *dev = container_of(v4l2_dev, struct cx88sdr_dev, v4l2_dev);
 
+	/* Powers the card up, the reference is dropped by the PCI core */
+	pm_runtime_forbid(&pdev->dev);
+	pm_runtime_get_noresume(&pdev->dev);
+	pm_runtime_dont_use_autosuspend(&pdev->dev);
+
+	/* The remaining users no longer touch the card */
+	v4l2_ctrl_lock(dev->ctrl_gain);
+	dev->hw_ready = false;
+	v4l2_ctrl_unlock(dev->ctrl_gain);
+	mutex_lock(&dev->dma_mlock);
+	dev->gone = true;
 	cx88sdr_shutdown(dev);
+	mutex_unlock(&dev->dma_mlock);
 	wmb(); /* Ensure card reset */
 
 	cx88sdr_pr_info("removing %s\n", video_device_node_name(&dev->vdev));
+	cx88sdr_debugfs_remove(dev);
 
 	mutex_lock(&cx88sdr_devlist_lock);
 	list_del(&dev->devlist);
 	mutex_unlock(&cx88sdr_devlist_lock);
-	cx88sdr_devcount--;
+
+	/* Streaming I/O waiters in DQBUF return an error, not a buffer */
+	mutex_lock(&dev->vdev_mlock);
+	vb2_queue_error(&dev->vb_queue);
+	mutex_unlock(&dev->vdev_mlock);
 
 	video_unregister_device(&dev->vdev);
-	v4l2_ctrl_handler_free(&dev->ctrl_handler);
 	v4l2_device_unregister(&dev->v4l2_dev);
 
-	/* Release resources */
-	free_irq(dev->irq, dev);
-	iounmap(dev->mmio);
-	cx88sdr_free_dma_buffer(dev);
-	cx88sdr_free_risc_inst_buffer(dev);
-	pci_release_regions(pdev);
+	cx88sdr_irq_free(dev);
+	/* Blocked readers return -ENODEV */
+	wake_up_all(&dev->wq);
 	pci_disable_device(pdev);
+	v4l2_device_put(&dev->v4l2_dev);
 }
 
+/*
+ * Runtime suspend stops the card and lets the PCI core put it in D3hot, the
+ * DMA ring and the RISC program stay allocated. It only runs while the card
+ * is unused, except for system sleep, where a running engine is restarted on
+ * resume and its readers resync as after a synchronized start.
+ */
+static int cx88sdr_runtime_suspend(struct device *d)
+{
+	struct v4l2_device *v4l2_dev = dev_get_drvdata(d);
+	struct cx88sdr_dev *dev = container_of(v4l2_dev, struct cx88sdr_dev, v4l2_dev);
+
+	/* s_ctrl() stops writing registers before the card goes down */
+	v4l2_ctrl_lock(dev->ctrl_gain);
+	dev->hw_ready = false;
+	mutex_lock(&dev->dma_mlock);
+	cx88sdr_shutdown(dev);
+	mutex_unlock(&dev->dma_mlock);
+	v4l2_ctrl_unlock(dev->ctrl_gain);
+	synchronize_irq(dev->irq);
+	return 0;
+}
+
+static int cx88sdr_runtime_resume(struct device *d)
+{
+	struct v4l2_device *v4l2_dev = dev_get_drvdata(d);
+	struct cx88sdr_dev *dev = container_of(v4l2_dev, struct cx88sdr_dev, v4l2_dev);
+
+	/*
+	 * Under the control lock, so a control set while the card comes up is
+	 * either applied here or by s_ctrl() once hw_ready is set.
+	 */
+	v4l2_ctrl_lock(dev->ctrl_gain);
+	mutex_lock(&dev->dma_mlock);
+	cx88sdr_shadow_invalidate(dev);
+	cx88sdr_hw_setup(dev);
+	dev->vid_intmsk = INTERRUPT_MASK;
+	mmio_iowrite32(dev, MO_VID_INTMSK, INTERRUPT_MASK);
+	if (dev->intr_users)
+		mmio_iowrite32(dev, MO_PCI_INTMSK, 1);
+	if (dev->dma_users)
+		cx88sdr_dma_start(dev);
+	mutex_unlock(&dev->dma_mlock);
+	dev->hw_ready = true;
+	v4l2_ctrl_unlock(dev->ctrl_gain);
+	return 0;
+}
+
+static const struct dev_pm_ops cx88sdr_pm_ops = {
+	SET_SYSTEM_SLEEP_PM_OPS(pm_runtime_force_suspend, pm_runtime_force_resume)
+	SET_RUNTIME_PM_OPS(cx88sdr_runtime_suspend, cx88sdr_runtime_resume, NULL)
+};
+
 static struct pci_device_id cx88sdr_pci_tbl[] = {
 	{
 		.vendor		= 0x14f1,
@@ -418,6 +1243,29 @@ static struct pci_driver cx88sdr_pci_driver = {
 	.id_table	= cx88sdr_pci_tbl,
 	.probe		= cx88sdr_probe,
 	.remove		= cx88sdr_remove,
+	/* Nothing else waits for the cards, don't hold up the boot */
+	.driver		= {
+		.probe_type	= PROBE_PREFER_ASYNCHRONOUS,
+		.pm		= &cx88sdr_pm_ops,
+	},
 };
 
-module_pci_driver(cx88sdr_pci_driver);
+static int __init cx88sdr_init(void)
+{
+	int ret;
+
+	cx88sdr_debugfs_init();
+	ret = pci_register_driver(&cx88sdr_pci_driver);
+	if (ret)
+		cx88sdr_debugfs_exit();
+	return ret;
+}
+
+static void __exit cx88sdr_exit(void)
+{
+	pci_unregister_driver(&cx88sdr_pci_driver);
+	cx88sdr_debugfs_exit();
+}
+
+module_init(cx88sdr_init);
+module_exit(cx88sdr_exit);
@@ -0,0 +1,114 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * cx88_sdr_debugfs.c - CX2388x SDR V4L2 Driver
+ * Copyright (c) 2020 Jorge Maidana <jorgem.seq@gmail.com>
+ *
+ * Runtime statistics in /sys/kernel/debug/cx88_sdr/<card>/stats.
+ */
+
+#include <linux/debugfs.h>
+#include <linux/math64.h>
+#include <linux/pci.h>
+#include <linux/pm_runtime.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+
+#include "cx88_sdr.h"
+
+static struct dentry *cx88sdr_debugfs_root;
+
+/* Average RISC IRQ rate in mHz over the recorded timestamps */
+static u64 cx88sdr_irq_rate(struct cx88sdr_dev *dev)
+{
+	struct cx88sdr_ts *ts;
+	u64 rate = 0;
+	u32 n;
+
+	ts = kmalloc_array(CX88SDR_TS_ENTRIES, sizeof(*ts), GFP_KERNEL);
+	if (!ts)
+		return 0;
+	n = cx88sdr_ts_get(dev, ts, CX88SDR_TS_ENTRIES);
+	if ((n > 1) && (ts[n - 1].ns > ts[0].ns))
+		rate = div64_u64((u64)(n - 1) * NSEC_PER_SEC * 1000,
+				 ts[n - 1].ns - ts[0].ns);
+	kfree(ts);
+	return rate;
+}
+
+static int cx88sdr_stats_show(struct seq_file *m, void *v)
+{
+	struct cx88sdr_dev *dev = m->private;
+	u64 rate = cx88sdr_irq_rate(dev);
+	/* The registers of a powered down card can't be read */
+	bool active = pm_runtime_get_if_in_use(&dev->pdev->dev) > 0;
+
+	seq_printf(m, "irqs: %llu\n", dev->stats.irqs);
+	seq_printf(m, "risc_irq_rate: %llu.%03llu Hz\n", rate / 1000, rate % 1000);
+	seq_printf(m, "read_bytes: %lld\n",
+		   (s64)atomic64_read(&dev->stats.read_bytes));
+	seq_printf(m, "read_wait_us: %lld\n",
+		   (s64)atomic64_read(&dev->stats.wait_ns) / NSEC_PER_USEC);
+	seq_printf(m, "overruns: %lld\n", atomic64_read(&dev->overruns));
+	seq_printf(m, "dropped_bytes: %lld\n",
+		   atomic64_read(&dev->dropped_bytes));
+	seq_printf(m, "openers: %d\n", atomic_read(&dev->stats.openers));
+	seq_printf(m, "dma_users: %d\n", READ_ONCE(dev->dma_users));
+	seq_printf(m, "pages_written: %llu\n",
+		   active ? cx88sdr_gp_sync(dev) : READ_ONCE(dev->gp_total));
+	seq_printf(m, "ring_pages: %u\n", dev->dma_pages);
+	seq_printf(m, "irq_pages: %u\n", dev->irq_pages);
+	seq_printf(m, "pci_latency: %d\n", dev->pci_lat);
+	seq_printf(m, "msi: %d\n", dev->pdev->msi_enabled);
+	seq_printf(m, "numa_node: %d\n", dev->node);
+	seq_printf(m, "dma_mode: %s\n",
+		   dev->dma_streaming ? "streaming" : "coherent");
+	seq_printf(m, "dma_guard_pages: %u\n", dev->dma_guard);
+	/* Streaming pages are placed by the driver, the coherent ones are not */
+	if (dev->dma_streaming)
+		seq_printf(m, "ring_remote_pages: %u\n",
+			   READ_ONCE(dev->dma_remote_pages));
+	if (active) {
+		cx88sdr_readers_show(dev, m);
+		pm_runtime_put_autosuspend(&dev->pdev->dev);
+	}
+	return 0;
+}
+
+static int cx88sdr_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, cx88sdr_stats_show, inode->i_private);
+}
+
+static const struct file_operations cx88sdr_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= cx88sdr_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+void cx88sdr_debugfs_init(void)
+{
+	cx88sdr_debugfs_root = debugfs_create_dir(KBUILD_MODNAME, NULL);
+}
+
+void cx88sdr_debugfs_exit(void)
+{
+	debugfs_remove_recursive(cx88sdr_debugfs_root);
+}
+
+void cx88sdr_debugfs_add(struct cx88sdr_dev *dev)
+{
+	char name[16];
+
+	snprintf(name, sizeof(name), "%d", dev->nr);
+	dev->debugfs = debugfs_create_dir(name, cx88sdr_debugfs_root);
+	debugfs_create_file("stats", 0444, dev->debugfs, dev,
+			    &cx88sdr_stats_fops);
+}
+
+void cx88sdr_debugfs_remove(struct cx88sdr_dev *dev)
+{
+	debugfs_remove_recursive(dev->debugfs);
+	dev->debugfs = NULL;
+}
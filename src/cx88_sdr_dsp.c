@@ -0,0 +1,312 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * cx88_sdr_dsp.c - CX2388x SDR V4L2 Driver
+ * Copyright (c) 2020 Jorge Maidana <jorgem.seq@gmail.com>
+ *
+ * Sample format conversion done while copying out of the DMA ring.
+ */
+
+#include <linux/bitops.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+
+#include "cx88_sdr.h"
+
+static const struct cx88sdr_format cx88sdr_formats[] = {
+	{ CX88SDR_FMT_RU8,	"Real U8",		1 },
+	{ CX88SDR_FMT_RS16LE,	"Real S16LE",		2 },
+	{ V4L2_SDR_FMT_CU8,	NULL,			2 },
+	{ V4L2_SDR_FMT_CS8,	NULL,			2 },
+	{ V4L2_SDR_FMT_CU16LE,	NULL,			4 },
+	{ V4L2_SDR_FMT_RU12LE,	NULL,			2 },
+	{ CX88SDR_FMT_CF32,	"Complex F32",		8 },
+};
+
+const struct cx88sdr_format *cx88sdr_format_enum(unsigned int index)
+{
+	if (index >= ARRAY_SIZE(cx88sdr_formats))
+		return NULL;
+	return &cx88sdr_formats[index];
+}
+
+const struct cx88sdr_format *cx88sdr_format_find(u32 pixelformat)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(cx88sdr_formats); i++) {
+		if (cx88sdr_formats[i].pixelformat == pixelformat)
+			return &cx88sdr_formats[i];
+	}
+	return NULL;
+}
+
+/* The buffers are allocated on node, the one of the card */
+int cx88sdr_dsp_init(struct cx88sdr_dsp *dsp, int node)
+{
+	dsp->work = kvmalloc_node(PAGE_SIZE * sizeof(*dsp->work), GFP_KERNEL,
+				  node);
+	dsp->hb_buf = kvmalloc_node((PAGE_SIZE + CX88SDR_HB_TAPS - 1) *
+				    sizeof(*dsp->hb_buf), GFP_KERNEL, node);
+	dsp->out = kvmalloc_node(PAGE_SIZE * CX88SDR_FMT_SAMPLE_MAX, GFP_KERNEL,
+				 node);
+	dsp->out_len = 0;
+	dsp->out_off = 0;
+	memset(dsp->hb, 0, sizeof(dsp->hb));
+	if (!dsp->work || !dsp->hb_buf || !dsp->out) {
+		cx88sdr_dsp_free(dsp);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+void cx88sdr_dsp_free(struct cx88sdr_dsp *dsp)
+{
+	kvfree(dsp->work);
+	kvfree(dsp->hb_buf);
+	kvfree(dsp->out);
+	dsp->work = NULL;
+	dsp->hb_buf = NULL;
+	dsp->out = NULL;
+}
+
+/*
+ * 11 tap half-band low-pass in Q15, every other tap but the center is zero.
+ * Flat to about 0.15 fs, the output is real at half the input rate.
+ */
+#define HB_C0	321
+#define HB_C2	(-2025)
+#define HB_C4	9896
+#define HB_C5	16384
+
+/*
+ * Filter and decimate n samples by 2 in place, returns the number of output
+ * samples. The symmetric taps are added before the multiply, so only four
+ * multiplies are needed per output sample. The last input samples and the
+ * output phase are kept in hb for the next call.
+ */
+static size_t cx88sdr_hb_decimate(struct cx88sdr_hb *hb, s16 *ext, s16 *buf,
+				  size_t n)
+{
+	size_t i, m = 0;
+	s32 acc;
+
+	memcpy(ext, hb->hist, sizeof(hb->hist));
+	memcpy(ext + CX88SDR_HB_TAPS - 1, buf, n * sizeof(*buf));
+
+	for (i = hb->phase; i < n; i += 2, m++) {
+		const s16 *x = ext + i;
+
+		acc = HB_C0 * (x[0] + x[10]) + HB_C2 * (x[2] + x[8]) +
+		      HB_C4 * (x[4] + x[6]) + HB_C5 * x[5];
+		buf[m] = clamp_t(s32, (acc + (1 << 14)) >> 15, S16_MIN, S16_MAX);
+	}
+
+	hb->phase = hb->phase + 2 * m - n;
+	memcpy(hb->hist, ext + n, sizeof(hb->hist));
+	return m;
+}
+
+/*
+ * IEEE 754 single precision of v / 32768 built with integer operations,
+ * the FPU is not available in the kernel.
+ */
+static inline u32 cx88sdr_s16_to_f32(s16 v)
+{
+	u32 sign = 0, a = v, e;
+
+	if (!v)
+		return 0;
+	if (v < 0) {
+		sign = 1u << 31;
+		a = -(s32)v;
+	}
+	e = fls(a) - 1;
+	return sign | ((127 - 15 + e) << 23) | ((a << (23 - e)) & 0x7fffff);
+}
+
+/* Widen 8-bit offset binary samples to s16 */
+static void cx88sdr_u8_to_s16(s16 *dst, const u8 *src, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = (s16)((src[i] ^ 0x80) << 8);
+}
+
+/*
+ * Store n s16 samples as pixelformat, returns the number of bytes written.
+ * The imaginary part of the complex formats is zero. One loop per format
+ * and no branches inside the loops, so they stay cheap per sample.
+ */
+static size_t cx88sdr_s16_out(u32 pixelformat, void *dst, const s16 *src,
+			      size_t n)
+{
+	size_t i;
+
+	switch (pixelformat) {
+	case CX88SDR_FMT_RU8: {
+		u8 *d = dst;
+
+		for (i = 0; i < n; i++)
+			d[i] = (src[i] >> 8) ^ 0x80;
+		return n;
+	}
+	case CX88SDR_FMT_RS16LE: {
+		__le16 *d = dst;
+
+		for (i = 0; i < n; i++)
+			d[i] = cpu_to_le16(src[i]);
+		return n * 2;
+	}
+	case V4L2_SDR_FMT_CU8: {
+		u8 *d = dst;
+
+		for (i = 0; i < n; i++) {
+			d[2 * i] = (src[i] >> 8) ^ 0x80;
+			d[2 * i + 1] = 0x80;
+		}
+		return n * 2;
+	}
+	case V4L2_SDR_FMT_CS8: {
+		s8 *d = dst;
+
+		for (i = 0; i < n; i++) {
+			d[2 * i] = src[i] >> 8;
+			d[2 * i + 1] = 0;
+		}
+		return n * 2;
+	}
+	case V4L2_SDR_FMT_CU16LE: {
+		__le16 *d = dst;
+
+		for (i = 0; i < n; i++) {
+			d[2 * i] = cpu_to_le16((u16)(src[i] ^ 0x8000));
+			d[2 * i + 1] = cpu_to_le16(0x8000);
+		}
+		return n * 4;
+	}
+	case V4L2_SDR_FMT_RU12LE: {
+		__le16 *d = dst;
+
+		for (i = 0; i < n; i++)
+			d[i] = cpu_to_le16((u16)(src[i] ^ 0x8000) >> 4);
+		return n * 2;
+	}
+	case CX88SDR_FMT_CF32: {
+		__le32 *d = dst;
+
+		for (i = 0; i < n; i++) {
+			d[2 * i] = cpu_to_le32(cx88sdr_s16_to_f32(src[i]));
+			d[2 * i + 1] = 0;
+		}
+		return n * 8;
+	}
+	}
+	return 0;
+}
+
+/* Snapshot of the settings a conversion depends on */
+void cx88sdr_dsp_conv_get(struct cx88sdr_dev *dev, struct cx88sdr_conv *conv)
+{
+	conv->in_16bit = cx88sdr_rate_16bit(dev);
+	conv->decimation = dev->decimation;
+	conv->pixelformat = cx88sdr_pixelformat(dev);
+	conv->out_size = cx88sdr_format_find(conv->pixelformat)->sample_size;
+}
+
+/* Most bytes cx88sdr_dsp_convert() can store for len bytes of ring data */
+size_t cx88sdr_dsp_out_max(const struct cx88sdr_conv *conv, size_t len)
+{
+	size_t n = conv->in_16bit ? len / 2 : len;
+
+	/* Each half-band stage hands out at most one sample over half */
+	if (conv->decimation)
+		n = (n >> conv->decimation) + 1;
+	return n * conv->out_size;
+}
+
+/*
+ * Convert len bytes of ring data, at most one page, to the format of conv.
+ * Returns the number of bytes stored in dst.
+ */
+size_t cx88sdr_dsp_convert(struct cx88sdr_dsp *dsp,
+			   const struct cx88sdr_conv *conv,
+			   void *dst, const void *src, size_t len)
+{
+	const s16 *samples;
+	size_t n;
+	u32 stage;
+
+	if (conv->in_16bit) {
+		n = len / 2;
+#ifdef __LITTLE_ENDIAN
+		samples = src;
+#else
+		{
+			const __le16 *s = src;
+			size_t i;
+
+			for (i = 0; i < n; i++)
+				dsp->work[i] = le16_to_cpu(s[i]);
+			samples = dsp->work;
+		}
+#endif
+	} else {
+		n = len;
+		cx88sdr_u8_to_s16(dsp->work, src, n);
+		samples = dsp->work;
+	}
+
+	if (conv->decimation) {
+		if (samples != dsp->work)
+			memcpy(dsp->work, samples, n * sizeof(*samples));
+		for (stage = 0; stage < conv->decimation; stage++)
+			n = cx88sdr_hb_decimate(&dsp->hb[stage], dsp->hb_buf,
+						dsp->work, n);
+		samples = dsp->work;
+	}
+
+	return cx88sdr_s16_out(conv->pixelformat, dst, samples, n);
+}
+
+/*
+ * Add len bytes of native samples to the level of a block. The sums of one
+ * page fit in 32 bits per sample, the block total in 64 bits.
+ */
+void cx88sdr_dsp_levels(struct cx88sdr_dev *dev, struct cx88sdr_level_acc *acc,
+			const void *src, size_t len)
+{
+	u32 peak = acc->peak, clipped = 0;
+	u64 sum = 0;
+	size_t i, n;
+
+	if (cx88sdr_rate_16bit(dev)) {
+		const __le16 *s = src;
+
+		n = len / 2;
+		for (i = 0; i < n; i++) {
+			s32 v = (s16)le16_to_cpu(s[i]);
+
+			sum += (u32)(v * v);
+			peak = max_t(u32, peak, abs(v));
+			clipped += (v == S16_MIN) || (v == S16_MAX);
+		}
+	} else {
+		const u8 *s = src;
+
+		n = len;
+		for (i = 0; i < n; i++) {
+			s32 v = ((s32)s[i] - 128) * 256;
+
+			sum += (u32)(v * v);
+			peak = max_t(u32, peak, abs(v));
+			clipped += (s[i] == 0) || (s[i] == 0xff);
+		}
+	}
+
+	acc->sum_sq += sum;
+	acc->samples += n;
+	acc->peak = peak;
+	acc->clipped += clipped;
+}
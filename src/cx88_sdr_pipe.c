@@ -0,0 +1,173 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * cx88_sdr_pipe.c - CX2388x SDR V4L2 Driver pipe feeder
+ * Copyright (c) 2020 Jorge Maidana <jorgem.seq@gmail.com>
+ *
+ * Feeds the native samples of the mmap()'d DMA ring to a pipe on stdout.
+ * The ring pages are reused by the card, so they can't be handed to the pipe
+ * as they are: each segment is copied once into fresh page-aligned memory,
+ * which is then given to the pipe with vmsplice(SPLICE_F_GIFT) and unmapped.
+ * The pipe keeps a reference to the pages instead of copying them, so the
+ * samples are copied once on the way in, where cat(1) copies them into its
+ * buffer with read() and again into the pipe with write().
+ *
+ * make pipe
+ * ./cx88_sdr_pipe [-b KiB] /dev/swradioN | consumer
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "cx88_sdr_uapi.h"
+
+/* The pipe is grown to this if allowed, see /proc/sys/fs/pipe-max-size */
+#define PIPE_SIZE	(1 << 20)
+
+/* Copy len bytes of the ring into new pages and gift them to the pipe */
+static int gift(const char *src, size_t len)
+{
+	struct iovec iov;
+	ssize_t ret;
+	char *buf;
+
+	buf = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED)
+		return -errno;
+	memcpy(buf, src, len);
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	while (iov.iov_len) {
+		ret = vmsplice(STDOUT_FILENO, &iov, 1, SPLICE_F_GIFT);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			munmap(buf, len);
+			return ret;
+		}
+		iov.iov_base = (char *)iov.iov_base + ret;
+		iov.iov_len -= ret;
+	}
+
+	/* Gifted pages must not be written again, the pipe owns them now */
+	munmap(buf, len);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-b KiB] device | consumer\n"
+		"  -b  bytes per vmsplice() in KiB, multiple of 4 (default 256)\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct pollfd pfd = { .events = POLLIN };
+	struct cx88sdr_segments s;
+	struct cx88sdr_ring ring;
+	size_t off, len, chunk = 256 << 10;
+	uint64_t overruns = 0;
+	struct stat st;
+	int opt, fd, ret = 0;
+	uint32_t i;
+	int64_t pos;
+	char *map;
+
+	while ((opt = getopt(argc, argv, "b:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			chunk = (size_t)atoi(optarg) << 10;
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if ((argc - optind != 1) || !chunk || (chunk % 4096)) {
+		usage(argv[0]);
+		return 2;
+	}
+	if (fstat(STDOUT_FILENO, &st) || !S_ISFIFO(st.st_mode)) {
+		fprintf(stderr, "stdout must be a pipe\n");
+		return 2;
+	}
+	/* A consumer that goes away ends the feed with EPIPE */
+	signal(SIGPIPE, SIG_IGN);
+	/* Fewer wakeups of the consumer, not needed for correctness */
+	fcntl(STDOUT_FILENO, F_SETPIPE_SZ, PIPE_SIZE);
+
+	fd = open(argv[optind], O_RDWR);
+	if (fd < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (ioctl(fd, CX88SDR_IOC_G_RING, &ring)) {
+		perror("CX88SDR_IOC_G_RING");
+		return 1;
+	}
+	map = mmap(NULL, ring.size, PROT_READ, MAP_SHARED, fd,
+		   ring.mmap_offset);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	pfd.fd = fd;
+	for (;;) {
+		if ((poll(&pfd, 1, 1000) < 0) && (errno != EINTR)) {
+			ret = -errno;
+			break;
+		}
+		if (ioctl(fd, CX88SDR_IOC_G_SEGMENTS, &s)) {
+			ret = -errno;
+			break;
+		}
+		if (s.overrun)
+			overruns++;
+
+		pos = s.pos;
+		for (i = 0; (i < s.count) && !ret; i++) {
+			for (off = 0; off < s.seg[i].length; off += len) {
+				len = s.seg[i].length - off;
+				if (len > chunk)
+					len = chunk;
+				ret = gift(map + s.seg[i].offset + off, len);
+				if (ret)
+					break;
+				pos = s.seg[i].pos + off + len;
+			}
+		}
+		if ((pos != s.pos) && ioctl(fd, CX88SDR_IOC_RELEASE, &pos)) {
+			ret = -errno;
+			break;
+		}
+		if (ret)
+			break;
+	}
+
+	if (ret && (ret != -EPIPE))
+		fprintf(stderr, "feed stopped: %s\n", strerror(-ret));
+	if (overruns)
+		fprintf(stderr, "%llu overruns\n", (unsigned long long)overruns);
+	munmap(map, ring.size);
+	close(fd);
+	return (ret && (ret != -EPIPE)) ? 1 : 0;
+}
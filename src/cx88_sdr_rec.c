@@ -0,0 +1,426 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * cx88_sdr_rec.c - CX2388x SDR V4L2 Driver direct-to-disk recorder
+ * Copyright (c) 2020 Jorge Maidana <jorgem.seq@gmail.com>
+ *
+ * Writes the mmap()'d DMA ring to a file opened with O_DIRECT in large
+ * aligned chunks, so the samples bypass the page cache and are never
+ * copied by read(). The settings, the RISC interrupt timestamps, the
+ * settings changes and the overruns are written as JSON lines to
+ * <file>.meta, positions there are byte offsets in the data file. At stop
+ * the data short of a chunk is written without O_DIRECT, its length is the
+ * tail_bytes of the end record.
+ *
+ * make rec
+ * ./cx88_sdr_rec [-t seconds] [-r rate] [-i input] [-g gain] [-c MiB] /dev/swradioN file
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "cx88_sdr_uapi.h"
+
+static const struct cx88sdr_rate rates[CX88SDR_RATE_NUM] = CX88SDR_RATES;
+
+#define RATE_NUM	CX88SDR_RATE_NUM
+
+static volatile sig_atomic_t stop;
+
+struct rec {
+	int		fd;
+	int		out;
+	FILE		*meta;
+	char		*ring;
+	uint32_t	ring_size;
+	size_t		chunk;
+	char		*bounce;	/* Used if the ring can't be written directly */
+	uint64_t	byte_rate;	/* Ring bytes per second */
+	int64_t		start_pos;	/* read() position of file offset 0 */
+	uint64_t	written;
+	uint64_t	tail;		/* Written at stop, without O_DIRECT */
+	uint64_t	dropped;
+	uint64_t	last_ts_ns;
+	uint32_t	mark_seq;
+};
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int ctrl_set(int fd, uint32_t id, int value)
+{
+	struct v4l2_control ctrl = { .id = id, .value = value };
+
+	return ioctl(fd, VIDIOC_S_CTRL, &ctrl);
+}
+
+static int ctrl_get(int fd, uint32_t id)
+{
+	struct v4l2_control ctrl = { .id = id };
+
+	if (ioctl(fd, VIDIOC_G_CTRL, &ctrl))
+		return -1;
+	return ctrl.value;
+}
+
+/*
+ * The ring is a DMA coherent mapping that O_DIRECT usually can't pin, in
+ * that case the chunk goes through an aligned bounce buffer, still without
+ * the page cache.
+ */
+static int write_chunk(struct rec *r, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	if (!r->bounce) {
+		ret = write(r->out, buf, len);
+		if ((ret >= 0) || (errno != EFAULT))
+			goto done;
+		if (posix_memalign((void **)&r->bounce, 4096, r->chunk))
+			return -ENOMEM;
+	}
+	memcpy(r->bounce, buf, len);
+	ret = write(r->out, r->bounce, len);
+done:
+	if (ret < 0)
+		return -errno;
+	if ((size_t)ret != len)
+		return -EIO;
+	r->written += len;
+	return 0;
+}
+
+static void meta_timestamps(struct rec *r)
+{
+	struct cx88sdr_timestamps t;
+	uint32_t i;
+
+	if (ioctl(r->fd, CX88SDR_IOC_G_TIMESTAMPS, &t))
+		return;
+	for (i = 0; i < t.count; i++) {
+		if (t.entry[i].timestamp_ns <= r->last_ts_ns)
+			continue;
+		/* Before the start or inside a gap */
+		if (t.entry[i].pos < r->start_pos + (int64_t)r->dropped)
+			continue;
+		fprintf(r->meta, "{\"type\":\"timestamp\",\"offset\":%lld,"
+			"\"monotonic_ns\":%llu}\n",
+			(long long)(t.entry[i].pos - r->start_pos - r->dropped),
+			(unsigned long long)t.entry[i].timestamp_ns);
+		r->last_ts_ns = t.entry[i].timestamp_ns;
+	}
+}
+
+static void meta_marks(struct rec *r)
+{
+	struct cx88sdr_marks m;
+	uint32_t i;
+
+	if (ioctl(r->fd, CX88SDR_IOC_G_MARKS, &m))
+		return;
+	for (i = 0; i < m.count; i++) {
+		if ((int32_t)(m.entry[i].seq - r->mark_seq) <= 0)
+			continue;
+		fprintf(r->meta, "{\"type\":\"settings\",\"offset\":%lld,"
+			"\"rate\":%u,\"input\":%u,\"gain\":%u}\n",
+			(long long)(m.entry[i].pos - r->start_pos - r->dropped),
+			m.entry[i].rate, m.entry[i].input, m.entry[i].gain);
+		r->mark_seq = m.entry[i].seq;
+		if (m.entry[i].rate < RATE_NUM)
+			r->byte_rate = (uint64_t)rates[m.entry[i].rate].hz *
+				       rates[m.entry[i].rate].sample_size;
+	}
+}
+
+static void meta_overrun(struct rec *r, struct cx88sdr_segments *s)
+{
+	if (!s->overrun)
+		return;
+	/* The file stays contiguous, record where the gap is */
+	fprintf(r->meta, "{\"type\":\"overrun\",\"offset\":%llu}\n",
+		(unsigned long long)r->written);
+	r->dropped = s->pos - r->start_pos - r->written;
+}
+
+/*
+ * Write the complete chunks of the ready segments. A segment that ends at the
+ * end of the ring is written up to there, the positions stay page aligned as
+ * O_DIRECT needs. Returns the ready bytes left for the next chunk.
+ */
+static int64_t record_segments(struct rec *r, struct cx88sdr_segments *s)
+{
+	int64_t pos = s->pos, ready = 0;
+	uint32_t i;
+	size_t off, len;
+	int ret;
+
+	for (i = 0; i < s->count; i++)
+		ready += s->seg[i].length;
+
+	for (i = 0; i < s->count; i++) {
+		int wraps = s->seg[i].offset + s->seg[i].length == r->ring_size;
+
+		for (off = 0; off < s->seg[i].length; off += len) {
+			len = s->seg[i].length - off;
+			if (len > r->chunk)
+				len = r->chunk;
+			else if ((len < r->chunk) && !wraps)
+				break;
+			ret = write_chunk(r, r->ring + s->seg[i].offset + off,
+					  len);
+			if (ret)
+				return ret;
+			pos = s->seg[i].pos + off + len;
+		}
+		if (off < s->seg[i].length)
+			break;
+	}
+	if (pos == s->pos)
+		return ready;
+	if (ioctl(r->fd, CX88SDR_IOC_RELEASE, &pos))
+		return -errno;
+	return ready - (pos - s->pos);
+}
+
+/*
+ * At stop, write what is ready, shorter than a chunk, through the page cache
+ * since O_DIRECT needs aligned lengths. The data file keeps its layout.
+ */
+static int record_tail(struct rec *r, struct cx88sdr_segments *s)
+{
+	int64_t pos = s->pos;
+	uint64_t written = r->written;
+	uint32_t i;
+	size_t off, len;
+	int flags, ret;
+
+	flags = fcntl(r->out, F_GETFL);
+	if ((flags < 0) || fcntl(r->out, F_SETFL, flags & ~O_DIRECT))
+		return -errno;
+
+	for (i = 0; i < s->count; i++) {
+		for (off = 0; off < s->seg[i].length; off += len) {
+			len = s->seg[i].length - off;
+			if (len > r->chunk)
+				len = r->chunk;
+			ret = write_chunk(r, r->ring + s->seg[i].offset + off,
+					  len);
+			if (ret)
+				return ret;
+			pos = s->seg[i].pos + off + len;
+		}
+	}
+	r->tail = r->written - written;
+	if ((pos != s->pos) && ioctl(r->fd, CX88SDR_IOC_RELEASE, &pos))
+		return -errno;
+	return 0;
+}
+
+/*
+ * poll() returns as soon as one page is ready, sleep instead until the rest
+ * of the chunk should be there. The chunk is at most half of the ring the
+ * card may fill, so the sleep itself leaves it room, a disk that stalls for
+ * longer still overruns and shows up in the meta file.
+ */
+static void wait_chunk(struct rec *r, int64_t ready)
+{
+	uint64_t ns;
+	struct timespec ts;
+
+	if ((uint64_t)ready >= r->chunk)
+		return;
+	ns = (r->chunk - ready) * 1000000000ull / r->byte_rate;
+	ts.tv_sec = ns / 1000000000ull;
+	ts.tv_nsec = ns % 1000000000ull;
+	nanosleep(&ts, NULL);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-t seconds] [-r rate] [-i input] [-g gain] [-c MiB] device file\n"
+		"  -t  recording length in seconds (default until SIGINT)\n"
+		"  -r  rate menu index, 0-5\n"
+		"  -i  input menu index, 0-3\n"
+		"  -g  gain, 0-31\n"
+		"  -c  write size in MiB, power of 2 (default 4)\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct rec r = { .fd = -1, .out = -1, .chunk = 4 << 20 };
+	struct pollfd pfd = { .events = POLLIN };
+	struct cx88sdr_segments s;
+	struct cx88sdr_ring ring;
+	int opt, ret = 0, rate = -1, input = -1, gain = -1, seconds = 0;
+	int64_t ready;
+	uint64_t end = 0, usable;
+	char *meta_path;
+
+	while ((opt = getopt(argc, argv, "t:r:i:g:c:h")) != -1) {
+		switch (opt) {
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'r':
+			rate = atoi(optarg);
+			break;
+		case 'i':
+			input = atoi(optarg);
+			break;
+		case 'g':
+			gain = atoi(optarg);
+			break;
+		case 'c':
+			r.chunk = (size_t)atoi(optarg) << 20;
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if ((argc - optind != 2) || !r.chunk || (r.chunk & (r.chunk - 1))) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	r.fd = open(argv[optind], O_RDWR);
+	if (r.fd < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (((rate >= 0) && ctrl_set(r.fd, V4L2_CID_CX88SDR_RATE, rate)) ||
+	    ((input >= 0) && ctrl_set(r.fd, V4L2_CID_CX88SDR_INPUT, input)) ||
+	    ((gain >= 0) && ctrl_set(r.fd, V4L2_CID_GAIN, gain))) {
+		perror("VIDIOC_S_CTRL");
+		return 1;
+	}
+	rate = ctrl_get(r.fd, V4L2_CID_CX88SDR_RATE);
+	if ((rate < 0) || (rate >= (int)RATE_NUM)) {
+		fprintf(stderr, "can't get the sampling rate\n");
+		return 1;
+	}
+
+	if (ioctl(r.fd, CX88SDR_IOC_G_RING, &ring)) {
+		perror("CX88SDR_IOC_G_RING");
+		return 1;
+	}
+	/*
+	 * Leave the card room to write while a chunk is on its way to disk.
+	 * The guard pages at the end of the ring are not ours to wait on.
+	 */
+	usable = ring.size - (uint64_t)ring.guard_pages * ring.page_size;
+	while ((r.chunk > usable / 2) && (r.chunk > ring.page_size))
+		r.chunk /= 2;
+	r.ring_size = ring.size;
+	r.byte_rate = (uint64_t)rates[rate].hz * rates[rate].sample_size;
+	r.ring = mmap(NULL, ring.size, PROT_READ, MAP_SHARED, r.fd,
+		      ring.mmap_offset);
+	if (r.ring == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	r.out = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT,
+		     0644);
+	if (r.out < 0) {
+		perror(argv[optind + 1]);
+		return 1;
+	}
+	if (asprintf(&meta_path, "%s.meta", argv[optind + 1]) < 0)
+		return 1;
+	r.meta = fopen(meta_path, "w");
+	if (!r.meta) {
+		perror(meta_path);
+		return 1;
+	}
+
+	/* A new open file starts at a page boundary */
+	if (ioctl(r.fd, CX88SDR_IOC_G_SEGMENTS, &s)) {
+		perror("CX88SDR_IOC_G_SEGMENTS");
+		return 1;
+	}
+	r.start_pos = s.pos;
+
+	fprintf(r.meta, "{\"type\":\"start\",\"device\":\"%s\",\"rate\":%d,"
+		"\"sample_rate\":%u,\"format\":\"%s\",\"input\":%d,\"gain\":%d,"
+		"\"monotonic_ns\":%llu}\n", argv[optind], rate, rates[rate].hz,
+		(rates[rate].sample_size == 2) ? "RS16" : "RU08",
+		ctrl_get(r.fd, V4L2_CID_CX88SDR_INPUT),
+		ctrl_get(r.fd, V4L2_CID_GAIN), (unsigned long long)now_ns());
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	if (seconds > 0)
+		end = now_ns() + (uint64_t)seconds * 1000000000ull;
+
+	pfd.fd = r.fd;
+	while (!stop && (!end || now_ns() < end)) {
+		if ((poll(&pfd, 1, 1000) < 0) && (errno != EINTR)) {
+			ret = -errno;
+			break;
+		}
+		if (ioctl(r.fd, CX88SDR_IOC_G_SEGMENTS, &s)) {
+			ret = -errno;
+			break;
+		}
+		meta_overrun(&r, &s);
+		ready = record_segments(&r, &s);
+		if (ready < 0) {
+			ret = ready;
+			break;
+		}
+		meta_timestamps(&r);
+		meta_marks(&r);
+		wait_chunk(&r, ready);
+	}
+
+	if (!ret) {
+		if (ioctl(r.fd, CX88SDR_IOC_G_SEGMENTS, &s)) {
+			ret = -errno;
+		} else {
+			meta_overrun(&r, &s);
+			ret = record_tail(&r, &s);
+			meta_timestamps(&r);
+			meta_marks(&r);
+		}
+	}
+
+	if (ret)
+		fprintf(stderr, "recording stopped: %s\n", strerror(-ret));
+	fprintf(r.meta, "{\"type\":\"end\",\"bytes\":%llu,\"tail_bytes\":%llu,"
+		"\"dropped_bytes\":%llu,\"monotonic_ns\":%llu}\n",
+		(unsigned long long)r.written, (unsigned long long)r.tail,
+		(unsigned long long)r.dropped, (unsigned long long)now_ns());
+	fclose(r.meta);
+	close(r.out);
+	munmap(r.ring, ring.size);
+	close(r.fd);
+	free(r.bounce);
+	free(meta_path);
+	return ret ? 1 : 0;
+}
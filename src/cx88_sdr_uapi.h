@@ -0,0 +1,244 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later WITH Linux-syscall-note */
+/*
+ * cx88_sdr_uapi.h - CX2388x SDR V4L2 Driver, user space interface
+ * Copyright (c) 2020 Jorge Maidana <jorgem.seq@gmail.com>
+ */
+
+#ifndef CX88SDR_UAPI_H
+#define CX88SDR_UAPI_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+#include <linux/videodev2.h>
+
+/*
+ * Driver specific sample formats. The card writes RU8 samples at the 8-bit
+ * rates and RS16LE samples at the 16-bit rates, the other formats are
+ * converted by the driver. The imaginary part of the complex formats is 0.
+ */
+#define CX88SDR_FMT_RU8		v4l2_fourcc('R', 'U', '0', '8') /* real u8 */
+#define CX88SDR_FMT_RS16LE	v4l2_fourcc('R', 'S', '1', '6') /* real s16le */
+#define CX88SDR_FMT_CF32	v4l2_fourcc('C', 'F', '3', '2') /* complex float32le */
+
+/* The base for the cx88_sdr driver controls. Total of 16 controls are reserved
+ * for this driver */
+#define V4L2_CID_USER_CX88SDR_BASE	(V4L2_CID_USER_BASE + 0x1f10)
+
+enum {
+	V4L2_CID_CX88SDR_INPUT = (V4L2_CID_USER_CX88SDR_BASE + 0),
+	V4L2_CID_CX88SDR_RATE,
+	/* Menu, decimate by 1 << value with half-band filters */
+	V4L2_CID_CX88SDR_DECIMATION,
+	/* Boolean, measure the levels returned by CX88SDR_IOC_G_LEVELS */
+	V4L2_CID_CX88SDR_LEVELS,
+};
+
+/*
+ * The V4L2_CID_CX88SDR_RATE menu in order, the sampling rate in Hz and the
+ * bytes per native sample of each entry. CX88SDR_RATES initializes an array
+ * of struct cx88sdr_rate, so the tools share one table with the driver.
+ */
+struct cx88sdr_rate {
+	__u32	hz;
+	__u32	sample_size;
+};
+
+#define CX88SDR_RATE_NUM	6
+#define CX88SDR_RATES { \
+	{ 14318182, 1 }, \
+	{ 28636363, 1 }, \
+	{ 35795454, 1 }, \
+	{  7159091, 2 }, \
+	{ 14318182, 2 }, \
+	{ 17897727, 2 }, \
+}
+
+/* mmap() offset of the DMA ring, lower offsets map videobuf2 buffers */
+#define CX88SDR_RING_MMAP_OFFSET	0x40000000
+
+/*
+ * DMA ring layout and RISC write position.
+ * The ring can be mapped read-only with mmap() at mmap_offset. Pages before
+ * wr_page (modulo the ring) hold complete samples, wr_page may still be
+ * written by the card.
+ *
+ * When read() falls a whole ring behind the card, or the card laps the start
+ * of a copy while it is made, it skips to the live write page and the copied
+ * bytes are not returned. overrun is then set until the next CX88SDR_IOC_G_RING call and the
+ * per-open overruns and dropped_bytes counters are incremented. The file
+ * position still advances by the dropped bytes.
+ *
+ * With the streaming dma_mode the card owns the pages guard_pages before they
+ * are a whole ring behind it, their data is then lost already. It is 0 with
+ * the coherent mode.
+ */
+struct cx88sdr_ring {
+	__u32	size;		/* Ring size in bytes */
+	__u32	page_size;	/* Size of one ring page in bytes */
+	__u32	mmap_offset;	/* Offset to pass to mmap() */
+	__u32	wr_page;	/* Page being written by the RISC controller */
+	__u32	overrun;	/* Samples lost since the last call */
+	__u32	guard_pages;	/* Pages before a full lap that count as lost */
+	__u64	overruns;	/* Number of overruns */
+	__u64	dropped_bytes;	/* Bytes lost to overruns */
+	__u32	reserved[6];
+};
+
+#define CX88SDR_IOC_G_RING	_IOR('V', BASE_VIDIOC_PRIVATE + 0, struct cx88sdr_ring)
+
+/*
+ * Stream positions and CLOCK_MONOTONIC times of the last RISC interrupts,
+ * oldest first. All bytes before pos (the read() file position of this open
+ * file, negative if before its start) had been written at timestamp_ns.
+ * pos / sample_size is the native sample index. The entries are discarded
+ * when the DMA engine is restarted.
+ */
+#define CX88SDR_TIMESTAMPS_MAX	16
+
+struct cx88sdr_timestamp {
+	__u64	page;		/* Pages written since the module was loaded */
+	__s64	pos;		/* read() position in bytes */
+	__u64	timestamp_ns;	/* CLOCK_MONOTONIC */
+};
+
+struct cx88sdr_timestamps {
+	__u32	count;		/* Valid entries */
+	__u32	sample_size;	/* Bytes per native sample */
+	__u32	reserved[6];
+	struct cx88sdr_timestamp entry[CX88SDR_TIMESTAMPS_MAX];
+};
+
+#define CX88SDR_IOC_G_TIMESTAMPS _IOR('V', BASE_VIDIOC_PRIVATE + 1, struct cx88sdr_timestamps)
+
+/*
+ * Restart the DMA engines of the cards listed by number (the N of the
+ * "CX2388x SDR [N]" card of VIDIOC_QUERYCAP, in probe order, so it may change
+ * between boots) as close together in time as possible. All
+ * the cards must be capturing. Readers resync to start_page, which is
+ * also a CX88SDR_IOC_G_TIMESTAMPS entry. offset_ns is the start time of
+ * each card relative to cards[0].
+ */
+#define CX88SDR_SYNC_MAX	32
+
+struct cx88sdr_sync_start {
+	__u32	count;				/* Number of cards */
+	__u32	reserved0;
+	__u32	cards[CX88SDR_SYNC_MAX];
+	__u64	start_page[CX88SDR_SYNC_MAX];	/* First page of the run */
+	__u64	start_ns[CX88SDR_SYNC_MAX];	/* CLOCK_MONOTONIC */
+	__s64	offset_ns[CX88SDR_SYNC_MAX];
+	__u32	reserved[8];
+};
+
+#define CX88SDR_IOC_SYNC_START	_IOWR('V', BASE_VIDIOC_PRIVATE + 2, struct cx88sdr_sync_start)
+
+/*
+ * Last changes of the rate, input or gain, oldest first. The samples from pos
+ * on are captured with the new settings, the samples shortly before pos may
+ * mix both. rate and input are the values of the V4L2_CID_CX88SDR_RATE and
+ * V4L2_CID_CX88SDR_INPUT menus, seq counts all the changes since the module
+ * was loaded.
+ */
+#define CX88SDR_MARKS_MAX	16
+
+struct cx88sdr_mark_entry {
+	__u32	seq;
+	__u32	rate;
+	__u32	input;
+	__u32	gain;
+	__u64	page;		/* First page with the new settings */
+	__s64	pos;		/* read() position in bytes */
+};
+
+struct cx88sdr_marks {
+	__u32	count;		/* Valid entries */
+	__u32	reserved[7];
+	struct cx88sdr_mark_entry entry[CX88SDR_MARKS_MAX];
+};
+
+#define CX88SDR_IOC_G_MARKS	_IOR('V', BASE_VIDIOC_PRIVATE + 3, struct cx88sdr_marks)
+
+/*
+ * Cycle through the entries, applying the input and gain of each for at least
+ * dwell native samples. The switches happen on RISC interrupts, so dwell is
+ * rounded up to the irq_pages period, and each one is reported by
+ * CX88SDR_IOC_G_MARKS. count 0 stops the sweep, it is also stopped when the
+ * device is closed by all its users.
+ */
+#define CX88SDR_SWEEP_MAX	64
+
+struct cx88sdr_sweep_entry {
+	__u32	input;		/* V4L2_CID_CX88SDR_INPUT menu value */
+	__u32	gain;		/* V4L2_CID_GAIN value */
+	__u64	dwell;		/* Samples */
+};
+
+struct cx88sdr_sweep {
+	__u32	count;		/* Valid entries, 0 stops */
+	__u32	reserved[7];
+	struct cx88sdr_sweep_entry entry[CX88SDR_SWEEP_MAX];
+};
+
+#define CX88SDR_IOC_S_SWEEP	_IOW('V', BASE_VIDIOC_PRIVATE + 4, struct cx88sdr_sweep)
+
+/*
+ * Ready samples of the mmap()'d ring between the read() position and the
+ * page being written, without copying them. The ring is mapped linearly, so
+ * the ready samples only split in two segments when they wrap around its end.
+ * If the card has overwritten the read() position it first skips ahead as
+ * read() does and overrun is set. CX88SDR_IOC_RELEASE then moves the read()
+ * position past the consumed samples, up to the end of the last segment.
+ * The segments hold native samples, the format and decimation settings only
+ * apply to read() and streaming I/O.
+ */
+#define CX88SDR_SEGMENTS_MAX	2
+
+struct cx88sdr_segment {
+	__u32	offset;		/* Offset in the mmap()'d ring */
+	__u32	length;		/* Bytes */
+	__s64	pos;		/* read() position of the first byte */
+};
+
+struct cx88sdr_segments {
+	__u32	count;		/* Valid segments */
+	__u32	overrun;	/* The read() position has been skipped ahead */
+	__s64	pos;		/* read() position */
+	__u32	reserved[4];
+	struct cx88sdr_segment seg[CX88SDR_SEGMENTS_MAX];
+};
+
+#define CX88SDR_IOC_G_SEGMENTS	_IOR('V', BASE_VIDIOC_PRIVATE + 5, struct cx88sdr_segments)
+#define CX88SDR_IOC_RELEASE	_IOW('V', BASE_VIDIOC_PRIVATE + 6, __s64)
+
+/*
+ * Signal levels of the last blocks of native samples, oldest first. A block
+ * holds the pages completed between two RISC interrupts, it is measured while
+ * the V4L2_CID_CX88SDR_LEVELS or the V4L2_CID_AUTOGAIN control is set. The
+ * values are on the s16 scale, 8-bit samples count 256 times their offset
+ * from 128: power is the mean of the squared samples (1 << 30 is full scale),
+ * peak the largest magnitude, and clipped the number of samples at either end
+ * of the range. seq counts the blocks since the module was loaded.
+ */
+#define CX88SDR_LEVELS_MAX	16
+
+struct cx88sdr_level_entry {
+	__u32	seq;
+	__u32	samples;
+	__u32	power;
+	__u32	peak;
+	__u32	clipped;
+	__u32	gain;		/* V4L2_CID_GAIN value at the end of the block */
+	__u64	page;		/* First page after the block */
+	__s64	pos;		/* read() position of the end of the block */
+	__u64	timestamp_ns;	/* CLOCK_MONOTONIC of the end of the block */
+};
+
+struct cx88sdr_levels {
+	__u32	count;		/* Valid entries */
+	__u32	reserved[7];
+	struct cx88sdr_level_entry entry[CX88SDR_LEVELS_MAX];
+};
+
+#define CX88SDR_IOC_G_LEVELS	_IOR('V', BASE_VIDIOC_PRIVATE + 7, struct cx88sdr_levels)
+
+#endif
@@ -18,45 +18,162 @@
  * Copyright (c) 2013-2015 Chad Page <Chad.Page@gmail.com>
  */
 
+#include <linux/fs.h>
+#include <linux/interrupt.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/module.h>
 #include <linux/pci.h>
+#include <linux/poll.h>
+#include <linux/seq_file.h>
 #include <linux/videodev2.h>
 #include <media/v4l2-dev.h>
 #include <media/v4l2-event.h>
 #include <media/v4l2-ioctl.h>
+#include <media/videobuf2-vmalloc.h>
 
 #include "cx88_sdr.h"
 
 #define	CX88SDR_V4L2_NAME	"CX2388x SDR V4L2"
 
-/* The base for the cx88_sdr driver controls. Total of 16 controls are reserved
- * for this driver */
-#define V4L2_CID_USER_CX88SDR_BASE	(V4L2_CID_USER_BASE + 0x1f10)
-
-enum {
-	V4L2_CID_CX88SDR_INPUT = (V4L2_CID_USER_CX88SDR_BASE + 0),
-	V4L2_CID_CX88SDR_RATE,
-};
+static bool zero_pages;
+module_param(zero_pages, bool, 0644);
+MODULE_PARM_DESC(zero_pages, "Zero the DMA pages after they have been read, coherent dma_mode only");
 
 struct cx88sdr_fh {
 	struct v4l2_fh fh;
 	struct cx88sdr_dev *dev;
+	struct file *file;
+
+	/* Ring page at file position 0 */
+	u64 initial_page;
+
+	/* Overrun accounting */
+	u32 overrun;
+	u64 overruns;
+	u64 dropped_bytes;
+
+	/* Converted samples not yet read, allocated on the first conversion */
+	struct cx88sdr_dsp dsp;
 };
 
+/* Absolute ring page of a file position */
+static u64 cx88sdr_rd_page(struct cx88sdr_fh *fh, loff_t pos)
+{
+	return fh->initial_page + (pos >> PAGE_SHIFT);
+}
+
+/*
+ * The last completed page may still be in flight, pages before it are ready.
+ * If the RISC program has wrapped over the reader its pages are lost, skip to
+ * the live write page and account for the dropped bytes.
+ */
+static bool cx88sdr_rd_ready(u64 gp_total, u64 rd)
+{
+	return gp_total > rd + 1;
+}
+
+/* Number of ring pages from pnum that are contiguous in memory, up to max */
+static uint32_t cx88sdr_contig_pages(struct cx88sdr_dev *dev, uint32_t pnum,
+				     u64 max)
+{
+	uint32_t n = 1;
+	void *virt = dev->pgvec_virt[pnum];
+
+	while ((n < max) && (pnum + n < dev->dma_pages) &&
+	       (dev->pgvec_virt[pnum + n] == virt + (n << PAGE_SHIFT)))
+		n++;
+	return n;
+}
+
+/*
+ * Page to resume from when rd has been overwritten, or when it is from before
+ * a restart of the DMA engine. Returns 0 if rd can be read.
+ */
+static u64 cx88sdr_rd_resync(struct cx88sdr_dev *dev, u64 gp_total, u64 rd)
+{
+	u64 gp_base = cx88sdr_gp_base(dev);
+	/* Streaming slots are handed back to the card dma_guard pages early */
+	u64 lap = dev->dma_pages - dev->dma_guard;
+
+	if (gp_total - rd >= lap)
+		return gp_total - 1;
+	if (rd < gp_base)
+		return (gp_total - gp_base < lap) ? gp_base : gp_total - 1;
+	return 0;
+}
+
+/* Start at the page being written, or at the start of the current run */
+static u64 cx88sdr_rd_start(struct cx88sdr_dev *dev)
+{
+	u64 gp_total = cx88sdr_gp_sync(dev);
+	u64 gp_base = cx88sdr_gp_base(dev);
+
+	return (gp_total > gp_base) ? gp_total - 1 : gp_base;
+}
+
+/* Sleep until the RISC IRQ reports new pages or the card is removed */
+static int cx88sdr_rd_wait(struct cx88sdr_dev *dev, u64 rd)
+{
+	u64 start = ktime_get_ns();
+	int ret;
+
+	ret = wait_event_interruptible(dev->wq, READ_ONCE(dev->gone) ||
+			cx88sdr_rd_ready(cx88sdr_gp_sync(dev), rd));
+	atomic64_add(ktime_get_ns() - start, &dev->stats.wait_ns);
+	if (!ret && READ_ONCE(dev->gone))
+		return -ENODEV;
+	return ret;
+}
+
+/* Device totals, updated from every reader and from the IRQ thread */
+static void cx88sdr_overrun_add(struct cx88sdr_dev *dev, u64 dropped)
+{
+	atomic64_inc(&dev->overruns);
+	atomic64_add(dropped, &dev->dropped_bytes);
+}
+
+static void cx88sdr_rd_overrun(struct cx88sdr_fh *fh, loff_t *pos, u64 page)
+{
+	struct cx88sdr_dev *dev = fh->dev;
+	loff_t new_pos = (loff_t)(page - fh->initial_page) << PAGE_SHIFT;
+	u64 dropped = new_pos - *pos;
+
+	*pos = new_pos;
+	fh->overrun = 1;
+	fh->overruns++;
+	fh->dropped_bytes += dropped;
+	cx88sdr_overrun_add(dev, dropped);
+}
+
 static int cx88sdr_open(struct file *file)
 {
 	struct video_device *vdev = video_devdata(file);
 	struct cx88sdr_dev *dev = container_of(vdev, struct cx88sdr_dev, vdev);
 	struct cx88sdr_fh *fh;
+	int ret;
 
 	fh = kzalloc(sizeof(*fh), GFP_KERNEL);
+	if (!fh)
+		return -ENOMEM;
+
+	/* The first opener starts the DMA engine, the last one stops it */
+	ret = cx88sdr_dma_get(dev);
+	if (ret) {
+		kfree(fh);
+		return ret;
+	}
+
 	v4l2_fh_init(&fh->fh, vdev);
 
 	fh->dev = dev;
+	fh->file = file;
 	file->private_data = &fh->fh;
 	v4l2_fh_add(&fh->fh);
+	atomic_inc(&dev->stats.openers);
 
-	dev->initial_page = mmio_ioread32(dev, MO_VBI_GPCNT) - 1;
-	mmio_iowrite32(dev, MO_PCI_INTMSK, 1);
+	cx88sdr_intr_get(dev);
+	fh->initial_page = cx88sdr_rd_start(dev);
 	return 0;
 }
 
@@ -66,7 +183,17 @@ static int cx88sdr_release(struct file *file)
 	struct cx88sdr_fh *fh = container_of(vfh, struct cx88sdr_fh, fh);
 	struct cx88sdr_dev *dev = fh->dev;
 
-	mmio_iowrite32(dev, MO_PCI_INTMSK, 0);
+	mutex_lock(&dev->vdev_mlock);
+	if (dev->vb_queue.owner == vfh) {
+		vb2_queue_release(&dev->vb_queue);
+		dev->vb_queue.owner = NULL;
+	}
+	mutex_unlock(&dev->vdev_mlock);
+
+	cx88sdr_intr_put(dev);
+	cx88sdr_dma_put(dev);
+	cx88sdr_dsp_free(&fh->dsp);
+	atomic_dec(&dev->stats.openers);
 
 	v4l2_fh_del(&fh->fh);
 	v4l2_fh_exit(&fh->fh);
@@ -74,63 +201,295 @@ static int cx88sdr_release(struct file *file)
 	return 0;
 }
 
-static ssize_t cx88sdr_read(struct file *file, char __user *buf, size_t size,
-			    loff_t *pos)
+static ssize_t cx88sdr_read_raw(struct file *file, char __user *buf,
+				size_t size, loff_t *pos)
 {
 	struct v4l2_fh *vfh = file->private_data;
 	struct cx88sdr_fh *fh = container_of(vfh, struct cx88sdr_fh, fh);
 	struct cx88sdr_dev *dev = fh->dev;
 	ssize_t result = 0;
-	uint32_t gp_cnt, pnum;
+	uint32_t pnum;
+	u64 gp_total, rd, resync;
+	int ret;
 
-	pnum = (dev->initial_page +
-	       ((*pos % VBI_DMA_SIZE) >> PAGE_SHIFT)) % VBI_DMA_PAGES;
+	rd = cx88sdr_rd_page(fh, *pos);
 
-	gp_cnt = mmio_ioread32(dev, MO_VBI_GPCNT);
-	gp_cnt = (!gp_cnt) ? (VBI_DMA_PAGES - 1) : (gp_cnt - 1);
+	gp_total = cx88sdr_gp_sync(dev);
 
-	if ((pnum == gp_cnt) && (file->f_flags & O_NONBLOCK))
+	if (!cx88sdr_rd_ready(gp_total, rd) && (file->f_flags & O_NONBLOCK))
 		return result;
 
 	while (size) {
-		while ((size > 0) && (pnum != gp_cnt)) {
+		while ((size > 0) && cx88sdr_rd_ready(gp_total, rd)) {
 			uint32_t len;
 
-			/* Handle partial pages */
-			len = (*pos % PAGE_SIZE) ?
-			      (PAGE_SIZE - (*pos % PAGE_SIZE)) : PAGE_SIZE;
+			resync = cx88sdr_rd_resync(dev, gp_total, rd);
+			if (resync) {
+				cx88sdr_rd_overrun(fh, pos, resync);
+				rd = cx88sdr_rd_page(fh, *pos);
+				break;
+			}
+			pnum = rd & (dev->dma_pages - 1);
+
+			/* Copy up to the end of the contiguous ready pages */
+			len = (cx88sdr_contig_pages(dev, pnum, gp_total - 1 - rd)
+			       << PAGE_SHIFT) - (*pos % PAGE_SIZE);
 			if (len > size)
 				len = size;
 			if (copy_to_user(buf, dev->pgvec_virt[pnum] +
 					(*pos % PAGE_SIZE), len))
 				return -EFAULT;
 
-			memset(dev->pgvec_virt[pnum] + (*pos % PAGE_SIZE), 0, len);
+			/* The card may have lapped rd during the copy, drop it */
+			gp_total = cx88sdr_gp_sync(dev);
+			resync = cx88sdr_rd_resync(dev, gp_total, rd);
+			if (resync) {
+				cx88sdr_rd_overrun(fh, pos, resync);
+				rd = cx88sdr_rd_page(fh, *pos);
+				break;
+			}
+
+			/* Stale data detection, off by default */
+			if (zero_pages && !dev->dma_streaming)
+				memset(dev->pgvec_virt[pnum] + (*pos % PAGE_SIZE),
+				       0, len);
 
 			result += len;
 			buf += len;
 			*pos += len;
 			size -= len;
-			pnum = (dev->initial_page +
-			       ((*pos % VBI_DMA_SIZE) >> PAGE_SHIFT)) % VBI_DMA_PAGES;
+			rd = cx88sdr_rd_page(fh, *pos);
 		}
 		if (size) {
 			if (file->f_flags & O_NONBLOCK)
 				return result;
 
-			gp_cnt = mmio_ioread32(dev, MO_VBI_GPCNT);
-			gp_cnt = (!gp_cnt) ? (VBI_DMA_PAGES - 1) : (gp_cnt - 1);
+			ret = cx88sdr_rd_wait(dev, rd);
+			if (ret)
+				return result ? result : ret;
+			gp_total = cx88sdr_gp_sync(dev);
+		}
+	}
+	return result;
+}
+
+/*
+ * The file position keeps counting ring bytes, the converted samples of the
+ * current ring page are buffered until they have been read.
+ */
+static ssize_t cx88sdr_read_convert(struct file *file, char __user *buf,
+				    size_t size, loff_t *pos)
+{
+	struct v4l2_fh *vfh = file->private_data;
+	struct cx88sdr_fh *fh = container_of(vfh, struct cx88sdr_fh, fh);
+	struct cx88sdr_dev *dev = fh->dev;
+	struct cx88sdr_dsp *dsp = &fh->dsp;
+	ssize_t result = 0;
+	uint32_t pnum;
+	struct cx88sdr_conv conv;
+	u64 gp_total, rd, resync;
+	int ret;
+
+	if (!dsp->work) {
+		ret = cx88sdr_dsp_init(dsp, dev->node);
+		if (ret)
+			return ret;
+	}
+
+	while (size) {
+		size_t len, off;
+
+		if (dsp->out_off < dsp->out_len) {
+			len = min(size, dsp->out_len - dsp->out_off);
+			if (copy_to_user(buf, dsp->out + dsp->out_off, len))
+				return -EFAULT;
+			dsp->out_off += len;
+			result += len;
+			buf += len;
+			size -= len;
+			continue;
+		}
+
+		/* 16-bit samples must not be split */
+		cx88sdr_dsp_conv_get(dev, &conv);
+		if (conv.in_16bit)
+			*pos = ALIGN(*pos, 2);
+
+		rd = cx88sdr_rd_page(fh, *pos);
+		gp_total = cx88sdr_gp_sync(dev);
+		if (!cx88sdr_rd_ready(gp_total, rd)) {
+			if (file->f_flags & O_NONBLOCK)
+				return result;
+			ret = cx88sdr_rd_wait(dev, rd);
+			if (ret)
+				return result ? result : ret;
+			continue;
+		}
+		resync = cx88sdr_rd_resync(dev, gp_total, rd);
+		if (resync) {
+			cx88sdr_rd_overrun(fh, pos, resync);
+			continue;
+		}
+
+		pnum = rd & (dev->dma_pages - 1);
+		off = *pos % PAGE_SIZE;
+		len = PAGE_SIZE - off;
+		dsp->out_len = cx88sdr_dsp_convert(dsp, &conv, dsp->out,
+						   dev->pgvec_virt[pnum] + off,
+						   len);
+		dsp->out_off = 0;
+
+		/* The card may have lapped rd during the conversion, drop it */
+		resync = cx88sdr_rd_resync(dev, cx88sdr_gp_sync(dev), rd);
+		if (resync) {
+			dsp->out_len = 0;
+			cx88sdr_rd_overrun(fh, pos, resync);
+			continue;
 		}
+
+		/* Stale data detection, off by default */
+		if (zero_pages && !dev->dma_streaming)
+			memset(dev->pgvec_virt[pnum] + off, 0, len);
+		*pos += len;
 	}
 	return result;
 }
 
+static ssize_t cx88sdr_read(struct file *file, char __user *buf, size_t size,
+			    loff_t *pos)
+{
+	struct v4l2_fh *vfh = file->private_data;
+	struct cx88sdr_fh *fh = container_of(vfh, struct cx88sdr_fh, fh);
+	struct cx88sdr_dev *dev = fh->dev;
+	ssize_t ret;
+
+	/* Native samples are copied straight out of the ring */
+	if ((cx88sdr_pixelformat(dev) == cx88sdr_native_format(dev)) &&
+	    !dev->decimation &&
+	    (fh->dsp.out_off >= fh->dsp.out_len))
+		ret = cx88sdr_read_raw(file, buf, size, pos);
+	else
+		ret = cx88sdr_read_convert(file, buf, size, pos);
+	if (ret > 0)
+		atomic64_add(ret, &dev->stats.read_bytes);
+	return ret;
+}
+
+/* Ring fill level of each reader, for debugfs */
+void cx88sdr_readers_show(struct cx88sdr_dev *dev, struct seq_file *m)
+{
+	u64 gp_total = cx88sdr_gp_sync(dev);
+	struct v4l2_fh *vfh;
+	unsigned long flags;
+	int i = 0;
+
+	spin_lock_irqsave(&dev->vdev.fh_lock, flags);
+	list_for_each_entry(vfh, &dev->vdev.fh_list, list) {
+		struct cx88sdr_fh *fh = container_of(vfh, struct cx88sdr_fh, fh);
+		u64 rd = cx88sdr_rd_page(fh, READ_ONCE(fh->file->f_pos));
+		u64 fill = (gp_total > rd) ? gp_total - rd : 0;
+
+		seq_printf(m, "reader%d_fill_pages: %llu/%u\n", i, fill,
+			   dev->dma_pages);
+		seq_printf(m, "reader%d_overruns: %llu\n", i, fh->overruns);
+		i++;
+	}
+	spin_unlock_irqrestore(&dev->vdev.fh_lock, flags);
+}
+
+static __poll_t cx88sdr_poll(struct file *file, struct poll_table_struct *wait)
+{
+	struct v4l2_fh *vfh = file->private_data;
+	struct cx88sdr_fh *fh = container_of(vfh, struct cx88sdr_fh, fh);
+	struct cx88sdr_dev *dev = fh->dev;
+	__poll_t res;
+
+	if (dev->vb_queue.owner == vfh)
+		return vb2_fop_poll(file, wait);
+
+	res = v4l2_ctrl_poll(file, wait);
+	poll_wait(file, &dev->wq, wait);
+
+	/* Samples are ready when the reader is behind the RISC write page */
+	if (cx88sdr_rd_ready(cx88sdr_gp_sync(dev),
+			     cx88sdr_rd_page(fh, file->f_pos)))
+		res |= EPOLLIN | EPOLLRDNORM;
+	return res;
+}
+
+static int cx88sdr_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct v4l2_fh *vfh = file->private_data;
+	struct cx88sdr_fh *fh = container_of(vfh, struct cx88sdr_fh, fh);
+	struct cx88sdr_dev *dev = fh->dev;
+	unsigned long vm_start = vma->vm_start;
+	unsigned long vm_end = vma->vm_end;
+	unsigned long vm_pgoff = vma->vm_pgoff;
+	unsigned long addr = vm_start;
+	unsigned long pgoff, npages = vma_pages(vma);
+	unsigned long i, first;
+	int ret = 0;
+
+	/* Offsets below the ring belong to videobuf2 buffers */
+	if (vm_pgoff < (CX88SDR_RING_MMAP_OFFSET >> PAGE_SHIFT))
+		return vb2_fop_mmap(file, vma);
+	pgoff = vm_pgoff - (CX88SDR_RING_MMAP_OFFSET >> PAGE_SHIFT);
+
+	/* The ring is only written by the card */
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	if ((pgoff >= dev->dma_pages) || (npages > dev->dma_pages - pgoff))
+		return -EINVAL;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	/*
+	 * Map the part of each block covered by the vma, streaming blocks are
+	 * plain pages and stay cacheable in user space
+	 */
+	for (i = 0, first = 0; (i < dev->nr_chunks) && npages; i++) {
+		struct cx88sdr_dma_chunk *chunk = &dev->chunks[i];
+		unsigned long n = chunk->size >> PAGE_SHIFT;
+
+		if (pgoff < first + n) {
+			unsigned long off = pgoff - first;
+			unsigned long len = min(n - off, npages);
+			unsigned long pfn = page_to_pfn(virt_to_page(chunk->virt));
+
+			vma->vm_start = addr;
+			vma->vm_end = addr + (len << PAGE_SHIFT);
+			vma->vm_pgoff = off;
+			if (dev->dma_streaming)
+				ret = remap_pfn_range(vma, addr, pfn + off,
+						      len << PAGE_SHIFT,
+						      vma->vm_page_prot);
+			else
+				ret = dma_mmap_coherent(&dev->pdev->dev, vma,
+							chunk->virt, chunk->phy,
+							chunk->size);
+			if (ret)
+				break;
+			addr += len << PAGE_SHIFT;
+			pgoff += len;
+			npages -= len;
+		}
+		first += n;
+	}
+
+	vma->vm_start = vm_start;
+	vma->vm_end = vm_end;
+	vma->vm_pgoff = vm_pgoff;
+	return ret;
+}
+
 static const struct v4l2_file_operations cx88sdr_fops = {
 	.owner		= THIS_MODULE,
 	.open		= cx88sdr_open,
 	.release	= cx88sdr_release,
 	.read		= cx88sdr_read,
-	.poll		= v4l2_ctrl_poll,
+	.poll		= cx88sdr_poll,
+	.mmap		= cx88sdr_mmap,
 	.unlocked_ioctl	= video_ioctl2,
 };
 
@@ -139,38 +498,34 @@ static int cx88sdr_querycap(struct file *file, void *priv, struct v4l2_capabilit
 	struct cx88sdr_dev *dev = video_drvdata(file);
 
 	snprintf(cap->bus_info, sizeof(cap->bus_info), "PCI:%s", pci_name(dev->pdev));
-	strscpy(cap->card, CX88SDR_DRV_NAME, sizeof(cap->card));
+	/* With the card number, the SYNC_START cards are matched to bus_info */
+	strscpy(cap->card, dev->name, sizeof(cap->card));
 	strscpy(cap->driver, KBUILD_MODNAME, sizeof(cap->driver));
 	return 0;
 }
 
 static int cx88sdr_enum_fmt_sdr(struct file *file, void *priv, struct v4l2_fmtdesc *f)
 {
-	if (f->index > 1)
+	const struct cx88sdr_format *fmt = cx88sdr_format_enum(f->index);
+
+	if (!fmt)
 		return -EINVAL;
 
-	if (f->index == 0)
-		f->pixelformat = V4L2_SDR_FMT_CU8;
-	else if (f->index == 1)
-		f->pixelformat = V4L2_SDR_FMT_CU16LE;
+	f->pixelformat = fmt->pixelformat;
+	/* The V4L2 core only knows the description of the standard formats */
+	if (fmt->name)
+		strscpy(f->description, fmt->name, sizeof(f->description));
 	return 0;
 }
 
 static int cx88sdr_try_fmt_sdr(struct file *file, void *priv, struct v4l2_format *f)
 {
+	struct cx88sdr_dev *dev = video_drvdata(file);
+
 	memset(f->fmt.sdr.reserved, 0, sizeof(f->fmt.sdr.reserved));
-	switch (f->fmt.sdr.pixelformat) {
-	case V4L2_SDR_FMT_CU8:
-		f->fmt.sdr.buffersize = 1;
-		break;
-	case V4L2_SDR_FMT_CU16LE:
-		f->fmt.sdr.buffersize = 2;
-		break;
-	default:
-		f->fmt.sdr.pixelformat = V4L2_SDR_FMT_CU8;
-		f->fmt.sdr.buffersize = 1;
-		break;
-	}
+	if (!cx88sdr_format_find(f->fmt.sdr.pixelformat))
+		f->fmt.sdr.pixelformat = cx88sdr_native_format(dev);
+	f->fmt.sdr.buffersize = CX88SDR_VB_BUF_SIZE;
 	return 0;
 }
 
@@ -179,7 +534,7 @@ static int cx88sdr_g_fmt_sdr(struct file *file, void *priv, struct v4l2_format *
 	struct cx88sdr_dev *dev = video_drvdata(file);
 
 	memset(f->fmt.sdr.reserved, 0, sizeof(f->fmt.sdr.reserved));
-	f->fmt.sdr.pixelformat = dev->pixelformat;
+	f->fmt.sdr.pixelformat = cx88sdr_pixelformat(dev);
 	f->fmt.sdr.buffersize = dev->buffersize;
 	return 0;
 }
@@ -188,52 +543,532 @@ static int cx88sdr_s_fmt_sdr(struct file *file, void *priv, struct v4l2_format *
 {
 	struct cx88sdr_dev *dev = video_drvdata(file);
 
+	if (vb2_is_busy(&dev->vb_queue))
+		return -EBUSY;
+
 	memset(f->fmt.sdr.reserved, 0, sizeof(f->fmt.sdr.reserved));
+	if (cx88sdr_format_find(f->fmt.sdr.pixelformat))
+		dev->pixelformat = f->fmt.sdr.pixelformat;
+	else
+		f->fmt.sdr.pixelformat = cx88sdr_pixelformat(dev);
+	f->fmt.sdr.buffersize = dev->buffersize;
+	return 0;
+}
 
-	switch (f->fmt.sdr.pixelformat) {
-	case V4L2_SDR_FMT_CU8:
-		dev->pixelformat = V4L2_SDR_FMT_CU8;
-		dev->buffersize = 1;
-		f->fmt.sdr.buffersize = 1;
-		break;
-	case V4L2_SDR_FMT_CU16LE:
-		dev->pixelformat = V4L2_SDR_FMT_CU16LE;
-		dev->buffersize = 2;
-		f->fmt.sdr.buffersize = 2;
-		break;
-	default:
-		dev->pixelformat = V4L2_SDR_FMT_CU8;
-		dev->buffersize = 1;
-		f->fmt.sdr.pixelformat = V4L2_SDR_FMT_CU8;
-		f->fmt.sdr.buffersize = 1;
-		break;
+static int cx88sdr_g_ring(struct cx88sdr_fh *fh, struct cx88sdr_ring *ring)
+{
+	struct cx88sdr_dev *dev = fh->dev;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->size = dev->dma_size;
+	ring->page_size = PAGE_SIZE;
+	ring->mmap_offset = CX88SDR_RING_MMAP_OFFSET;
+	ring->guard_pages = dev->dma_guard;
+	ring->wr_page = (cx88sdr_gp_sync(dev) - 1) & (dev->dma_pages - 1);
+	ring->overrun = fh->overrun;
+	ring->overruns = fh->overruns;
+	ring->dropped_bytes = fh->dropped_bytes;
+	fh->overrun = 0;
+	return 0;
+}
+
+static int cx88sdr_g_timestamps(struct cx88sdr_fh *fh,
+				struct cx88sdr_timestamps *t)
+{
+	struct cx88sdr_dev *dev = fh->dev;
+	struct cx88sdr_ts ts[CX88SDR_TIMESTAMPS_MAX];
+	u32 i;
+
+	memset(t, 0, sizeof(*t));
+	t->count = cx88sdr_ts_get(dev, ts, CX88SDR_TIMESTAMPS_MAX);
+	t->sample_size = cx88sdr_rate_16bit(dev) ? 2 : 1;
+	for (i = 0; i < t->count; i++) {
+		t->entry[i].page = ts[i].page;
+		t->entry[i].pos = (s64)(ts[i].page - fh->initial_page) << PAGE_SHIFT;
+		t->entry[i].timestamp_ns = ts[i].ns;
 	}
 	return 0;
 }
 
+static int cx88sdr_g_marks(struct cx88sdr_fh *fh, struct cx88sdr_marks *m)
+{
+	struct cx88sdr_mark marks[CX88SDR_MARKS_MAX];
+	u32 i;
+
+	memset(m, 0, sizeof(*m));
+	m->count = cx88sdr_marks_get(fh->dev, marks, CX88SDR_MARKS_MAX);
+	for (i = 0; i < m->count; i++) {
+		m->entry[i].seq = marks[i].seq;
+		m->entry[i].rate = marks[i].rate;
+		m->entry[i].input = marks[i].input;
+		m->entry[i].gain = marks[i].gain;
+		m->entry[i].page = marks[i].page;
+		m->entry[i].pos = (s64)(marks[i].page - fh->initial_page) << PAGE_SHIFT;
+	}
+	return 0;
+}
+
+static int cx88sdr_g_levels(struct cx88sdr_fh *fh, struct cx88sdr_levels *l)
+{
+	struct cx88sdr_level levels[CX88SDR_LEVELS_MAX];
+	u32 i;
+
+	memset(l, 0, sizeof(*l));
+	l->count = cx88sdr_levels_get(fh->dev, levels, CX88SDR_LEVELS_MAX);
+	for (i = 0; i < l->count; i++) {
+		l->entry[i].seq = levels[i].seq;
+		l->entry[i].samples = levels[i].samples;
+		l->entry[i].power = levels[i].power;
+		l->entry[i].peak = levels[i].peak;
+		l->entry[i].clipped = levels[i].clipped;
+		l->entry[i].gain = levels[i].gain;
+		l->entry[i].page = levels[i].page;
+		l->entry[i].pos = (s64)(levels[i].page - fh->initial_page) << PAGE_SHIFT;
+		l->entry[i].timestamp_ns = levels[i].ns;
+	}
+	return 0;
+}
+
+static int cx88sdr_s_sweep(struct cx88sdr_dev *dev, struct cx88sdr_sweep *sw)
+{
+	u32 i, sample_size = cx88sdr_rate_16bit(dev) ? 2 : 1;
+
+	if (sw->count > CX88SDR_SWEEP_MAX)
+		return -EINVAL;
+	for (i = 0; i < sw->count; i++) {
+		if ((sw->entry[i].input > dev->ctrl_input->maximum) ||
+		    (sw->entry[i].gain > dev->ctrl_gain->maximum) ||
+		    !sw->entry[i].dwell)
+			return -EINVAL;
+	}
+
+	mutex_lock(&dev->sweep_mlock);
+	for (i = 0; i < sw->count; i++) {
+		dev->sweep[i].input = sw->entry[i].input;
+		dev->sweep[i].gain = sw->entry[i].gain;
+		dev->sweep[i].pages = DIV_ROUND_UP_ULL(sw->entry[i].dwell *
+						       sample_size, PAGE_SIZE);
+	}
+	dev->sweep_count = sw->count;
+	/* Start with the first entry on the next RISC IRQ */
+	dev->sweep_idx = sw->count - 1;
+	dev->sweep_next = 0;
+	mutex_unlock(&dev->sweep_mlock);
+	return 0;
+}
+
+/* read() position up to which the ring pages are complete */
+static loff_t cx88sdr_rd_end(struct cx88sdr_fh *fh, u64 gp_total)
+{
+	return (loff_t)(gp_total - 1 - fh->initial_page) << PAGE_SHIFT;
+}
+
+static int cx88sdr_g_segments(struct file *file, struct cx88sdr_fh *fh,
+			      struct cx88sdr_segments *s)
+{
+	struct cx88sdr_dev *dev = fh->dev;
+	loff_t pos = file->f_pos, end;
+	u64 gp_total, rd, resync;
+
+	memset(s, 0, sizeof(*s));
+	gp_total = cx88sdr_gp_sync(dev);
+	rd = cx88sdr_rd_page(fh, pos);
+	resync = cx88sdr_rd_resync(dev, gp_total, rd);
+	if (resync) {
+		cx88sdr_rd_overrun(fh, &pos, resync);
+		file->f_pos = pos;
+		rd = resync;
+		s->overrun = 1;
+	}
+	s->pos = pos;
+	if (!cx88sdr_rd_ready(gp_total, rd))
+		return 0;
+
+	end = cx88sdr_rd_end(fh, gp_total);
+	while ((pos < end) && (s->count < CX88SDR_SEGMENTS_MAX)) {
+		struct cx88sdr_segment *seg = &s->seg[s->count++];
+
+		seg->offset = ((cx88sdr_rd_page(fh, pos) & (dev->dma_pages - 1))
+			       << PAGE_SHIFT) + (pos % PAGE_SIZE);
+		seg->length = min_t(loff_t, end - pos, dev->dma_size - seg->offset);
+		seg->pos = pos;
+		pos += seg->length;
+	}
+	return 0;
+}
+
+static int cx88sdr_release_pos(struct file *file, struct cx88sdr_fh *fh,
+			       s64 *pos)
+{
+	u64 gp_total = cx88sdr_gp_sync(fh->dev);
+
+	if ((*pos < file->f_pos) ||
+	    !cx88sdr_rd_ready(gp_total, fh->initial_page) ||
+	    (*pos > cx88sdr_rd_end(fh, gp_total)))
+		return -EINVAL;
+	file->f_pos = *pos;
+	return 0;
+}
+
+static long cx88sdr_default(struct file *file, void *priv, bool valid_prio,
+			    unsigned int cmd, void *arg)
+{
+	struct v4l2_fh *vfh = file->private_data;
+	struct cx88sdr_fh *fh = container_of(vfh, struct cx88sdr_fh, fh);
+
+	switch (cmd) {
+	case CX88SDR_IOC_G_RING:
+		return cx88sdr_g_ring(fh, arg);
+	case CX88SDR_IOC_G_TIMESTAMPS:
+		return cx88sdr_g_timestamps(fh, arg);
+	case CX88SDR_IOC_SYNC_START:
+		return cx88sdr_sync_start(arg);
+	case CX88SDR_IOC_G_MARKS:
+		return cx88sdr_g_marks(fh, arg);
+	case CX88SDR_IOC_S_SWEEP:
+		return cx88sdr_s_sweep(fh->dev, arg);
+	case CX88SDR_IOC_G_SEGMENTS:
+		return cx88sdr_g_segments(file, fh, arg);
+	case CX88SDR_IOC_RELEASE:
+		return cx88sdr_release_pos(file, fh, arg);
+	case CX88SDR_IOC_G_LEVELS:
+		return cx88sdr_g_levels(fh, arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
 static const struct v4l2_ioctl_ops cx88sdr_ioctl_ops = {
 	.vidioc_querycap		= cx88sdr_querycap,
-	.vidioc_enum_fmt_sdr_cap	= cx88sdr_enum_fmt_sdr, /* Fictitious */
-	.vidioc_try_fmt_sdr_cap		= cx88sdr_try_fmt_sdr, /* Fictitious */
-	.vidioc_g_fmt_sdr_cap		= cx88sdr_g_fmt_sdr, /* Fictitious */
-	.vidioc_s_fmt_sdr_cap		= cx88sdr_s_fmt_sdr, /* Fictitious */
+	.vidioc_enum_fmt_sdr_cap	= cx88sdr_enum_fmt_sdr,
+	.vidioc_try_fmt_sdr_cap		= cx88sdr_try_fmt_sdr,
+	.vidioc_g_fmt_sdr_cap		= cx88sdr_g_fmt_sdr,
+	.vidioc_s_fmt_sdr_cap		= cx88sdr_s_fmt_sdr,
+	.vidioc_reqbufs			= vb2_ioctl_reqbufs,
+	.vidioc_create_bufs		= vb2_ioctl_create_bufs,
+	.vidioc_prepare_buf		= vb2_ioctl_prepare_buf,
+	.vidioc_querybuf		= vb2_ioctl_querybuf,
+	.vidioc_qbuf			= vb2_ioctl_qbuf,
+	.vidioc_dqbuf			= vb2_ioctl_dqbuf,
+	.vidioc_expbuf			= vb2_ioctl_expbuf,
+	.vidioc_streamon		= vb2_ioctl_streamon,
+	.vidioc_streamoff		= vb2_ioctl_streamoff,
 	.vidioc_log_status		= v4l2_ctrl_log_status,
 	.vidioc_subscribe_event		= v4l2_ctrl_subscribe_event,
 	.vidioc_unsubscribe_event	= v4l2_event_unsubscribe,
+	.vidioc_default			= cx88sdr_default,
 };
 
 const struct video_device cx88sdr_template = {
-	.device_caps	= (V4L2_CAP_SDR_CAPTURE | V4L2_CAP_READWRITE),
+	.device_caps	= (V4L2_CAP_SDR_CAPTURE | V4L2_CAP_READWRITE |
+			   V4L2_CAP_STREAMING),
 	.fops		= &cx88sdr_fops,
 	.ioctl_ops	= &cx88sdr_ioctl_ops,
 	.name		= CX88SDR_V4L2_NAME,
 	.release	= video_device_release_empty,
 };
 
+/* Ring pages that fill one buffer once converted to the format of conv */
+static uint32_t cx88sdr_vb_pages(struct cx88sdr_dev *dev,
+				 const struct cx88sdr_conv *conv)
+{
+	uint32_t in_size = conv->in_16bit ? 2 : 1;
+	uint32_t size = dev->buffersize;
+	uint32_t npages;
+
+	/* The half-band stages may hand out one more sample each */
+	if (conv->decimation)
+		size -= 2 * conv->out_size;
+
+	npages = ((u64)size * in_size << conv->decimation) /
+		 (conv->out_size << PAGE_SHIFT);
+	return max_t(uint32_t, npages, 1);
+}
+
+/*
+ * Copy complete ring pages into queued buffers, runs in the IRQ thread.
+ * The settings are read once per buffer, the rate and decimation controls
+ * may change while streaming.
+ */
+void cx88sdr_vb_fill(struct cx88sdr_dev *dev)
+{
+	struct cx88sdr_conv conv;
+	struct cx88sdr_buf *buf;
+	unsigned long flags;
+	size_t payload, plane_size;
+	u64 gp_total, resync, start;
+	uint32_t i, npages;
+	bool native;
+	void *ptr;
+
+	for (;;) {
+		cx88sdr_dsp_conv_get(dev, &conv);
+		npages = cx88sdr_vb_pages(dev, &conv);
+		native = (conv.pixelformat == (conv.in_16bit ?
+			  CX88SDR_FMT_RS16LE : CX88SDR_FMT_RU8)) &&
+			 !conv.decimation;
+
+		gp_total = cx88sdr_gp_sync(dev);
+		if (gp_total < dev->vb_page + npages + 1)
+			break;
+
+		/* Resync if the RISC program has wrapped over the queue */
+		resync = cx88sdr_rd_resync(dev, gp_total, dev->vb_page);
+		if (resync) {
+			cx88sdr_overrun_add(dev, (resync - dev->vb_page) <<
+					    PAGE_SHIFT);
+			dev->vb_page = resync;
+			continue;
+		}
+
+		spin_lock_irqsave(&dev->vb_lock, flags);
+		buf = list_first_entry_or_null(&dev->vb_queued,
+					       struct cx88sdr_buf, list);
+		if (buf)
+			list_del(&buf->list);
+		spin_unlock_irqrestore(&dev->vb_lock, flags);
+
+		/* No buffer queued, drop the pages, the sequence shows the gap */
+		if (!buf) {
+			dev->vb_page += npages;
+			dev->sequence++;
+			continue;
+		}
+
+		ptr = vb2_plane_vaddr(&buf->vb.vb2_buf, 0);
+		plane_size = vb2_plane_size(&buf->vb.vb2_buf, 0);
+		start = dev->vb_page;
+		for (i = 0, payload = 0; i < npages; i++) {
+			void *page = dev->pgvec_virt[dev->vb_page &
+						     (dev->dma_pages - 1)];
+
+			/* Never past the plane, whatever npages says */
+			if (payload + cx88sdr_dsp_out_max(&conv, PAGE_SIZE) >
+			    plane_size)
+				break;
+			if (native) {
+				memcpy(ptr + payload, page, PAGE_SIZE);
+				payload += PAGE_SIZE;
+			} else {
+				payload += cx88sdr_dsp_convert(&dev->vb_dsp,
+							       &conv,
+							       ptr + payload,
+							       page, PAGE_SIZE);
+			}
+			dev->vb_page++;
+		}
+
+		/* Lapped during the copy, requeue the buffer and resync */
+		resync = cx88sdr_rd_resync(dev, cx88sdr_gp_sync(dev), start);
+		if (resync) {
+			spin_lock_irqsave(&dev->vb_lock, flags);
+			list_add(&buf->list, &dev->vb_queued);
+			spin_unlock_irqrestore(&dev->vb_lock, flags);
+			cx88sdr_overrun_add(dev, (resync - start) << PAGE_SHIFT);
+			dev->vb_page = resync;
+			continue;
+		}
+
+		vb2_set_plane_payload(&buf->vb.vb2_buf, 0, payload);
+		/* Time of the last sample, from the RISC IRQ timestamps */
+		buf->vb.vb2_buf.timestamp = cx88sdr_ts_lookup(dev, dev->vb_page);
+		buf->vb.sequence = dev->sequence++;
+		vb2_buffer_done(&buf->vb.vb2_buf, VB2_BUF_STATE_DONE);
+	}
+}
+
+/*
+ * One gain step per block, down when it clipped and up when its peak stayed
+ * low. Blocks from before the last change taking effect are not judged, the
+ * sweep has precedence.
+ */
+static void cx88sdr_autogain(struct cx88sdr_dev *dev,
+			     const struct cx88sdr_level_acc *acc)
+{
+	s32 gain = dev->gain;
+
+	if (READ_ONCE(dev->sweep_count) || (acc->start < dev->autogain_next))
+		return;
+	if (acc->clipped > acc->samples / CX88SDR_AUTOGAIN_CLIP)
+		gain--;
+	else if (!acc->clipped && (acc->peak < CX88SDR_AUTOGAIN_LOW))
+		gain++;
+	gain = clamp_t(s32, gain, dev->ctrl_gain->minimum,
+		       dev->ctrl_gain->maximum);
+	if (gain == dev->gain)
+		return;
+
+	v4l2_ctrl_lock(dev->ctrl_gain);
+	__v4l2_ctrl_s_ctrl(dev->ctrl_gain, gain);
+	v4l2_ctrl_unlock(dev->ctrl_gain);
+	dev->autogain_next = cx88sdr_gp_sync(dev) + CX88SDR_MARK_GUARD_PAGES;
+}
+
+/* Measure the pages completed since the last RISC IRQ, runs in the IRQ thread */
+void cx88sdr_levels_update(struct cx88sdr_dev *dev)
+{
+	struct cx88sdr_level_acc *acc = &dev->level_acc;
+	struct cx88sdr_level lvl;
+	u64 gp_total, resync;
+
+	if (!dev->levels_on && !dev->autogain) {
+		dev->level_run = false;
+		return;
+	}
+
+	gp_total = cx88sdr_gp_sync(dev);
+	resync = dev->level_run ?
+		 cx88sdr_rd_resync(dev, gp_total, dev->level_page) : 0;
+	if (!dev->level_run || resync) {
+		/* Start a new block at the live page */
+		dev->level_page = resync ? resync : cx88sdr_rd_start(dev);
+		dev->level_run = true;
+		memset(acc, 0, sizeof(*acc));
+		acc->start = dev->level_page;
+		return;
+	}
+	if (!cx88sdr_rd_ready(gp_total, dev->level_page))
+		return;
+
+	while (cx88sdr_rd_ready(gp_total, dev->level_page)) {
+		cx88sdr_dsp_levels(dev, acc, dev->pgvec_virt[dev->level_page &
+					     (dev->dma_pages - 1)], PAGE_SIZE);
+		dev->level_page++;
+	}
+
+	lvl.page = dev->level_page;
+	lvl.ns = cx88sdr_ts_lookup(dev, dev->level_page);
+	lvl.samples = acc->samples;
+	lvl.power = div64_u64(acc->sum_sq, acc->samples);
+	lvl.peak = acc->peak;
+	lvl.clipped = acc->clipped;
+	lvl.gain = dev->gain;
+	cx88sdr_level_add(dev, &lvl);
+
+	if (dev->autogain)
+		cx88sdr_autogain(dev, acc);
+	memset(acc, 0, sizeof(*acc));
+	acc->start = dev->level_page;
+}
+
+static int cx88sdr_queue_setup(struct vb2_queue *vq, unsigned int *nbuffers,
+			       unsigned int *nplanes, unsigned int sizes[],
+			       struct device *alloc_devs[])
+{
+	struct cx88sdr_dev *dev = vb2_get_drv_priv(vq);
+
+	/* Need at least 8 buffers */
+	if (vq->num_buffers + *nbuffers < 8)
+		*nbuffers = 8 - vq->num_buffers;
+
+	if (*nplanes)
+		return (sizes[0] < dev->buffersize) ? -EINVAL : 0;
+
+	*nplanes = 1;
+	sizes[0] = dev->buffersize;
+	return 0;
+}
+
+static void cx88sdr_buf_queue(struct vb2_buffer *vb)
+{
+	struct vb2_v4l2_buffer *vbuf = to_vb2_v4l2_buffer(vb);
+	struct cx88sdr_dev *dev = vb2_get_drv_priv(vb->vb2_queue);
+	struct cx88sdr_buf *buf = container_of(vbuf, struct cx88sdr_buf, vb);
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->vb_lock, flags);
+	list_add_tail(&buf->list, &dev->vb_queued);
+	spin_unlock_irqrestore(&dev->vb_lock, flags);
+}
+
+static void cx88sdr_return_bufs(struct cx88sdr_dev *dev,
+				enum vb2_buffer_state state)
+{
+	struct cx88sdr_buf *buf, *tmp;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->vb_lock, flags);
+	list_for_each_entry_safe(buf, tmp, &dev->vb_queued, list) {
+		list_del(&buf->list);
+		vb2_buffer_done(&buf->vb.vb2_buf, state);
+	}
+	spin_unlock_irqrestore(&dev->vb_lock, flags);
+}
+
+static int cx88sdr_start_streaming(struct vb2_queue *vq, unsigned int count)
+{
+	struct cx88sdr_dev *dev = vb2_get_drv_priv(vq);
+	int ret;
+
+	ret = cx88sdr_dsp_init(&dev->vb_dsp, dev->node);
+	if (ret) {
+		cx88sdr_return_bufs(dev, VB2_BUF_STATE_QUEUED);
+		return ret;
+	}
+
+	ret = cx88sdr_dma_get(dev);
+	if (ret) {
+		cx88sdr_dsp_free(&dev->vb_dsp);
+		cx88sdr_return_bufs(dev, VB2_BUF_STATE_QUEUED);
+		return ret;
+	}
+	dev->vb_page = cx88sdr_rd_start(dev);
+	dev->sequence = 0;
+	dev->vb_streaming = true;
+	cx88sdr_intr_get(dev);
+	return 0;
+}
+
+static void cx88sdr_stop_streaming(struct vb2_queue *vq)
+{
+	struct cx88sdr_dev *dev = vb2_get_drv_priv(vq);
+
+	dev->vb_streaming = false;
+	cx88sdr_intr_put(dev);
+	synchronize_irq(dev->irq);
+	cx88sdr_dma_put(dev);
+	cx88sdr_dsp_free(&dev->vb_dsp);
+	cx88sdr_return_bufs(dev, VB2_BUF_STATE_ERROR);
+}
+
+const struct vb2_ops cx88sdr_vb2_ops = {
+	.queue_setup		= cx88sdr_queue_setup,
+	.buf_queue		= cx88sdr_buf_queue,
+	.start_streaming	= cx88sdr_start_streaming,
+	.stop_streaming		= cx88sdr_stop_streaming,
+	.wait_prepare		= vb2_ops_wait_prepare,
+	.wait_finish		= vb2_ops_wait_finish,
+};
+
+static const uint32_t cx88sdr_shadow_regs[SHADOW_NUM] = {
+	[SHADOW_CAPTURE_CTRL]	= MO_CAPTURE_CTRL,
+	[SHADOW_SCONV]		= MO_SCONV_REG,
+	[SHADOW_PLL]		= MO_PLL_REG,
+	[SHADOW_INPUT_FORMAT]	= MO_INPUT_FORMAT,
+	[SHADOW_AGC_GAIN_ADJ4]	= MO_AGC_GAIN_ADJ4,
+};
+
+/* Write a control register unless it already holds val */
+static void cx88sdr_shadow_write(struct cx88sdr_dev *dev, unsigned int idx,
+				 uint32_t val)
+{
+	if ((dev->shadow_valid & BIT(idx)) && (dev->shadow[idx] == val))
+		return;
+	mmio_iowrite32(dev, cx88sdr_shadow_regs[idx], val);
+	dev->shadow[idx] = val;
+	dev->shadow_valid |= BIT(idx);
+}
+
+/* The registers have been reset behind the shadows */
+void cx88sdr_shadow_invalidate(struct cx88sdr_dev *dev)
+{
+	dev->shadow_valid = 0;
+}
+
 static void cx88sdr_gain_set(struct cx88sdr_dev *dev)
 {
-	mmio_iowrite32(dev, MO_AGC_GAIN_ADJ4, (1 << 23) | (dev->gain << 16) |
-					      (0xff << 8));
+	cx88sdr_shadow_write(dev, SHADOW_AGC_GAIN_ADJ4, (1 << 23) |
+			     (dev->gain << 16) | (0xff << 8));
 }
 
 void cx88sdr_agc_setup(struct cx88sdr_dev *dev)
@@ -249,8 +1084,8 @@ void cx88sdr_agc_setup(struct cx88sdr_dev *dev)
 
 void cx88sdr_input_set(struct cx88sdr_dev *dev)
 {
-	mmio_iowrite32(dev, MO_INPUT_FORMAT, (1 << 16) | (dev->input << 14) |
-					     (1 << 13) | (1 << 4) | 0x1);
+	cx88sdr_shadow_write(dev, SHADOW_INPUT_FORMAT, (1 << 16) |
+			     (dev->input << 14) | (1 << 13) | (1 << 4) | 0x1);
 }
 
 void cx88sdr_rate_set(struct cx88sdr_dev *dev)
@@ -258,39 +1093,73 @@ void cx88sdr_rate_set(struct cx88sdr_dev *dev)
 	switch (dev->rate) {
 	/* 8-bit */
 	case RATE_4FSC_8BIT: /* 14.318182 MHz */
-		mmio_iowrite32(dev, MO_CAPTURE_CTRL, (1 << 6) | (3 << 1));
-		mmio_iowrite32(dev, MO_SCONV_REG, (1 << 17) * 2); // Freq / 2
-		mmio_iowrite32(dev, MO_PLL_REG, (1 << 26) | (0x14 << 20)); // Freq / 5 / 8 * 20
+		cx88sdr_shadow_write(dev, SHADOW_CAPTURE_CTRL, (1 << 6) | (3 << 1));
+		cx88sdr_shadow_write(dev, SHADOW_SCONV, (1 << 17) * 2); // Freq / 2
+		cx88sdr_shadow_write(dev, SHADOW_PLL, (1 << 26) | (0x14 << 20)); // Freq / 5 / 8 * 20
 		break;
 	case RATE_8FSC_8BIT: /* 28.636363 MHz */
-		mmio_iowrite32(dev, MO_CAPTURE_CTRL, (1 << 6) | (3 << 1));
-		mmio_iowrite32(dev, MO_SCONV_REG, (1 << 17)); // Freq
-		mmio_iowrite32(dev, MO_PLL_REG, (0x10 << 20)); // Freq / 2 / 8 * 16
+		cx88sdr_shadow_write(dev, SHADOW_CAPTURE_CTRL, (1 << 6) | (3 << 1));
+		cx88sdr_shadow_write(dev, SHADOW_SCONV, (1 << 17)); // Freq
+		cx88sdr_shadow_write(dev, SHADOW_PLL, (0x10 << 20)); // Freq / 2 / 8 * 16
 		break;
 	case RATE_10FSC_8BIT: /* 35.795454 MHz */
-		mmio_iowrite32(dev, MO_CAPTURE_CTRL, (1 << 6) | (3 << 1));
-		mmio_iowrite32(dev, MO_SCONV_REG, (1 << 17) * 4 / 5); // Freq * 5 / 4
-		mmio_iowrite32(dev, MO_PLL_REG, (0x14 << 20)); // Freq / 2 / 8 * 20
+		cx88sdr_shadow_write(dev, SHADOW_CAPTURE_CTRL, (1 << 6) | (3 << 1));
+		cx88sdr_shadow_write(dev, SHADOW_SCONV, (1 << 17) * 4 / 5); // Freq * 5 / 4
+		cx88sdr_shadow_write(dev, SHADOW_PLL, (0x14 << 20)); // Freq / 2 / 8 * 20
 		break;
 	/* 16-bit */
 	case RATE_2FSC_16BIT: /* 7.159091 MHz */
-		mmio_iowrite32(dev, MO_CAPTURE_CTRL, (1 << 6) | (1 << 5) | (3 << 1));
-		mmio_iowrite32(dev, MO_SCONV_REG, (1 << 17) * 2); // Freq / 2
-		mmio_iowrite32(dev, MO_PLL_REG, (1 << 26) | (0x14 << 20)); // Freq / 5 / 8 * 20
+		cx88sdr_shadow_write(dev, SHADOW_CAPTURE_CTRL, (1 << 6) | (1 << 5) | (3 << 1));
+		cx88sdr_shadow_write(dev, SHADOW_SCONV, (1 << 17) * 2); // Freq / 2
+		cx88sdr_shadow_write(dev, SHADOW_PLL, (1 << 26) | (0x14 << 20)); // Freq / 5 / 8 * 20
 		break;
 	case RATE_4FSC_16BIT: /* 14.318182 MHz */
-		mmio_iowrite32(dev, MO_CAPTURE_CTRL, (1 << 6) | (1 << 5) | (3 << 1));
-		mmio_iowrite32(dev, MO_SCONV_REG, (1 << 17)); // Freq
-		mmio_iowrite32(dev, MO_PLL_REG, (0x10 << 20)); // Freq / 2 / 8 * 16
+		cx88sdr_shadow_write(dev, SHADOW_CAPTURE_CTRL, (1 << 6) | (1 << 5) | (3 << 1));
+		cx88sdr_shadow_write(dev, SHADOW_SCONV, (1 << 17)); // Freq
+		cx88sdr_shadow_write(dev, SHADOW_PLL, (0x10 << 20)); // Freq / 2 / 8 * 16
 		break;
 	case RATE_5FSC_16BIT: /* 17.897727 MHz */
-		mmio_iowrite32(dev, MO_CAPTURE_CTRL, (1 << 6) | (1 << 5) | (3 << 1));
-		mmio_iowrite32(dev, MO_SCONV_REG, (1 << 17) * 4 / 5); // Freq * 5 / 4
-		mmio_iowrite32(dev, MO_PLL_REG, (0x14 << 20)); // Freq / 2 / 8 * 20
+		cx88sdr_shadow_write(dev, SHADOW_CAPTURE_CTRL, (1 << 6) | (1 << 5) | (3 << 1));
+		cx88sdr_shadow_write(dev, SHADOW_SCONV, (1 << 17) * 4 / 5); // Freq * 5 / 4
+		cx88sdr_shadow_write(dev, SHADOW_PLL, (0x14 << 20)); // Freq / 2 / 8 * 20
 		break;
 	}
 }
 
+/* Switch to the next sweep entry once the current one has dwelled enough */
+void cx88sdr_sweep_step(struct cx88sdr_dev *dev)
+{
+	struct cx88sdr_sweep_slot *step;
+	u64 gp_total;
+
+	mutex_lock(&dev->sweep_mlock);
+	if (!dev->sweep_count)
+		goto unlock;
+	gp_total = cx88sdr_gp_sync(dev);
+	if (gp_total < dev->sweep_next)
+		goto unlock;
+
+	dev->sweep_idx = (dev->sweep_idx + 1) % dev->sweep_count;
+	step = &dev->sweep[dev->sweep_idx];
+
+	/* Through the controls, so they and their events stay in sync */
+	v4l2_ctrl_lock(dev->ctrl_input);
+	__v4l2_ctrl_s_ctrl(dev->ctrl_input, step->input);
+	__v4l2_ctrl_s_ctrl(dev->ctrl_gain, step->gain);
+	v4l2_ctrl_unlock(dev->ctrl_input);
+
+	dev->sweep_next = gp_total + CX88SDR_MARK_GUARD_PAGES + step->pages;
+unlock:
+	mutex_unlock(&dev->sweep_mlock);
+}
+
+void cx88sdr_sweep_clear(struct cx88sdr_dev *dev)
+{
+	mutex_lock(&dev->sweep_mlock);
+	dev->sweep_count = 0;
+	mutex_unlock(&dev->sweep_mlock);
+}
+
 static int cx88sdr_s_ctrl(struct v4l2_ctrl *ctrl)
 {
 	struct cx88sdr_dev *dev = container_of(ctrl->handler,
@@ -299,19 +1168,44 @@ static int cx88sdr_s_ctrl(struct v4l2_ctrl *ctrl)
 	switch (ctrl->id) {
 	case V4L2_CID_GAIN:
 		dev->gain = ctrl->val;
-		cx88sdr_gain_set(dev);
 		break;
 	case V4L2_CID_CX88SDR_INPUT:
 		dev->input = ctrl->val;
-		cx88sdr_input_set(dev);
 		break;
 	case V4L2_CID_CX88SDR_RATE:
 		dev->rate = ctrl->val;
-		cx88sdr_rate_set(dev);
 		break;
+	case V4L2_CID_CX88SDR_DECIMATION:
+		dev->decimation = ctrl->val;
+		return 0;
+	case V4L2_CID_CX88SDR_LEVELS:
+		dev->levels_on = ctrl->val;
+		return 0;
+	case V4L2_CID_AUTOGAIN:
+		dev->autogain = ctrl->val;
+		return 0;
 	default:
 		return -EINVAL;
 	}
+
+	/*
+	 * A powered down card gets the new settings on resume, which holds the
+	 * control lock, as s_ctrl() callers do, while it sets the card up
+	 */
+	if (!dev->hw_ready)
+		return 0;
+	switch (ctrl->id) {
+	case V4L2_CID_GAIN:
+		cx88sdr_gain_set(dev);
+		break;
+	case V4L2_CID_CX88SDR_INPUT:
+		cx88sdr_input_set(dev);
+		break;
+	case V4L2_CID_CX88SDR_RATE:
+		cx88sdr_rate_set(dev);
+		break;
+	}
+	cx88sdr_mark(dev);
 	return 0;
 }
 
@@ -354,7 +1248,37 @@ const struct v4l2_ctrl_config cx88sdr_ctrl_rate = {
 	.name	= "Sampling Rate",
 	.type	= V4L2_CTRL_TYPE_MENU,
 	.min	= 0,
-	.max	= 5,
+	.max	= CX88SDR_RATE_NUM - 1,
 	.def	= 1,
 	.qmenu	= cx88sdr_ctrl_rate_menu_strings,
 };
+
+static const char * const cx88sdr_ctrl_decimation_menu_strings[] = {
+	"Off",
+	"2",
+	"4",
+	"8",
+	NULL,
+};
+
+const struct v4l2_ctrl_config cx88sdr_ctrl_decimation = {
+	.ops	= &cx88sdr_ctrl_ops,
+	.id	= V4L2_CID_CX88SDR_DECIMATION,
+	.name	= "Decimation",
+	.type	= V4L2_CTRL_TYPE_MENU,
+	.min	= 0,
+	.max	= CX88SDR_HB_STAGES,
+	.def	= 0,
+	.qmenu	= cx88sdr_ctrl_decimation_menu_strings,
+};
+
+const struct v4l2_ctrl_config cx88sdr_ctrl_levels = {
+	.ops	= &cx88sdr_ctrl_ops,
+	.id	= V4L2_CID_CX88SDR_LEVELS,
+	.name	= "Level Monitor",
+	.type	= V4L2_CTRL_TYPE_BOOLEAN,
+	.min	= 0,
+	.max	= 1,
+	.step	= 1,
+	.def	= 0,
+};